@@ -0,0 +1,722 @@
+// Benchmarks every built-in L-system over the generations allowed by menu():
+//   expansion       LSystem::generate() (StochasticLSystem::generate() for the stochastic
+//                   systems), ns per produced symbol
+//   interpretation  makeFigure(), vertices per second, turtle steps per vertex and vertices per
+//                   drawn segment (2 when the figure is drawn as sf::Lines, see choosePrimitive())
+//   draw            rasterizeParallel() into an offscreen WIDTH x HEIGHT framebuffer
+// Peak heap bytes of the expansion and of interpretation + draw are tracked by the
+// allocation functions below.
+//
+// Usage: spbu-semester1-fractals-bench [--json <file>] [--baseline <file>] [--threshold <ratio>] [--repeat <n>]
+//        spbu-semester1-fractals-bench --verify
+// With --baseline, every case slower (or bigger) than the baseline by more than the
+// threshold (0.1 by default) is reported and the exit code is 1.
+// With --verify nothing is timed: the serial, parallel and in-view builds of every figure are
+// checked to agree, and so are symbolOfStep() and FigureIndex with plain walks and scans.
+// Culled in-view builds are drawn next to the full ones and have to light the same pixels, and
+// so do the builds with duplicate segments removed. Stochastic figures, which are built whole
+// from a rewritten word, are checked to come out the same from the words of GenerationCache.
+// The context-sensitive rules are checked on the first generations of the Hogeweg plant.
+// Every mismatch is reported and the exit code is 1.
+
+#include <SFML/Graphics.hpp>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cmath>
+#include <random>
+#include <tuple>
+#include <algorithm>
+#include <memory>
+#include <new>
+
+#include "settings.h"
+#include "lsystem.h"
+#include "figure.h"
+#include "raster.h"
+#include "compact.h"
+#include "spatial.h"
+#include "dedup.h"
+
+// Heap accounting: every block carries its size in front of it
+std::atomic<size_t> heapBytes(0), heapPeak(0);
+const size_t HEAP_HEADER = 16;
+
+void* trackedAlloc(size_t size) {
+    void* block = malloc(size + HEAP_HEADER);
+    if (block == nullptr)
+        throw std::bad_alloc();
+    *static_cast<size_t*>(block) = size;
+    size_t now = heapBytes += size;
+    size_t peak = heapPeak;
+    while (now > peak and !heapPeak.compare_exchange_weak(peak, now)) {
+    }
+    return static_cast<char*>(block) + HEAP_HEADER;
+}
+
+void trackedFree(void* ptr) {
+    if (ptr == nullptr)
+        return;
+    void* block = static_cast<char*>(ptr) - HEAP_HEADER;
+    heapBytes -= *static_cast<size_t*>(block);
+    free(block);
+}
+
+void* operator new(size_t size) { return trackedAlloc(size); }
+void* operator new[](size_t size) { return trackedAlloc(size); }
+void operator delete(void* ptr) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr) noexcept { trackedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { trackedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { trackedFree(ptr); }
+
+// Starts a new peak measurement, peakSince() then gives the peak above the current usage
+size_t resetPeak() {
+    size_t now = heapBytes;
+    heapPeak = now;
+    return now;
+}
+
+size_t peakSince(size_t start) { return heapPeak - start; }
+
+struct BenchCase {
+    std::string fractal;
+    int minGens, maxGens;
+};
+
+struct BenchResult {
+    std::string fractal;
+    int gens;
+    uint64_t symbols, vertices, moves, segments;
+    double expandNsPerSymbol, interpretVerticesPerSecond, drawMs;
+    size_t expandPeakBytes, renderPeakBytes;
+};
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+BenchResult runCase(const std::string& fractal, int gens, int repeat) {
+    BenchResult res{fractal, gens, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    double expandTime = 1e300, interpretTime = 1e300, drawTime = 1e300;
+
+    for (int run = 0; run < repeat; ++run) {
+        size_t start = resetPeak();
+        if (isStochastic(fractal)) {
+            StochasticLSystem* lSystem = createStochasticLSystem(fractal, gens, FOREST_SEED);
+            auto expandStart = std::chrono::steady_clock::now();
+            lSystem->generate();
+            expandTime = std::min(expandTime, secondsSince(expandStart));
+            res.symbols = lSystem->getWord().size();
+            delete lSystem;
+        } else {
+            LSystem* lSystem = createLSystem(fractal, gens);
+            res.symbols = lSystem->getExpandedLength(lSystem->getInitAxiom(), gens);
+            auto expandStart = std::chrono::steady_clock::now();
+            lSystem->generate();
+            expandTime = std::min(expandTime, secondsSince(expandStart));
+            delete lSystem;
+        }
+        res.expandPeakBytes = std::max(res.expandPeakBytes, peakSince(start));
+
+        // makeFigure() takes the word of a stochastic figure from generationCache(), so it is
+        // rewritten there first and interpretation is timed alone
+        if (isStochastic(fractal)) {
+            StochasticLSystem* lSystem = createStochasticLSystem(fractal, gens, FOREST_SEED);
+            stochasticWord(fractal, lSystem, gens);
+            delete lSystem;
+        }
+
+        start = resetPeak();
+        {
+            sf::VertexArray figure(sf::LinesStrip);
+            FigureStats stats{};
+            auto interpretStart = std::chrono::steady_clock::now();
+            makeFigure(figure, nullptr, nullptr, fractal, gens, nullptr, 0, &stats);
+            interpretTime = std::min(interpretTime, secondsSince(interpretStart));
+            res.vertices = figure.getVertexCount();
+            res.moves = stats.moves;
+            res.segments = stats.segments;
+
+            sf::FloatRect bounds = figure.getBounds();
+            double scale = std::max(1e-9, double(std::max(bounds.width / WIDTH, bounds.height / HEIGHT)));
+            std::vector<sf::Uint8> pixels;
+            auto drawStart = std::chrono::steady_clock::now();
+            rasterizeParallel(figure, bounds.left, bounds.top, scale, figureColor(fractal), sf::Color::Black,
+                              WIDTH, HEIGHT, 1, pixels);
+            drawTime = std::min(drawTime, secondsSince(drawStart));
+        }
+        res.renderPeakBytes = std::max(res.renderPeakBytes, peakSince(start));
+    }
+
+    res.expandNsPerSymbol = expandTime * 1e9 / double(std::max<uint64_t>(1, res.symbols));
+    res.interpretVerticesPerSecond = double(res.vertices) / std::max(1e-12, interpretTime);
+    res.drawMs = drawTime * 1e3;
+    return res;
+}
+
+// One case per line, so that readBaseline() can stay a line scanner
+void writeJson(std::ostream& out, const std::vector<BenchResult>& results) {
+    out << "{\"cases\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        out << "  {\"fractal\": \"" << r.fractal << "\", \"gens\": " << r.gens
+            << ", \"symbols\": " << r.symbols << ", \"vertices\": " << r.vertices << ", \"moves\": " << r.moves
+            << ", \"segments\": " << r.segments
+            << ", \"expand_ns_per_symbol\": " << r.expandNsPerSymbol
+            << ", \"interpret_vertices_per_s\": " << r.interpretVerticesPerSecond
+            << ", \"draw_ms\": " << r.drawMs
+            << ", \"expand_peak_bytes\": " << r.expandPeakBytes
+            << ", \"render_peak_bytes\": " << r.renderPeakBytes << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]}\n";
+}
+
+double jsonNumber(const std::string& line, const std::string& key) {
+    size_t pos = line.find("\"" + key + "\": ");
+    if (pos == std::string::npos)
+        return 0;
+    return atof(line.c_str() + pos + key.size() + 4);
+}
+
+std::string jsonString(const std::string& line, const std::string& key) {
+    size_t pos = line.find("\"" + key + "\": \"");
+    if (pos == std::string::npos)
+        return "";
+    pos += key.size() + 5;
+    return line.substr(pos, line.find('"', pos) - pos);
+}
+
+std::vector<BenchResult> readBaseline(const std::string& path) {
+    std::vector<BenchResult> results;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.find("\"fractal\"") == std::string::npos)
+            continue;
+        BenchResult r{};
+        r.fractal = jsonString(line, "fractal");
+        r.gens = int(jsonNumber(line, "gens"));
+        r.symbols = uint64_t(jsonNumber(line, "symbols"));
+        r.vertices = uint64_t(jsonNumber(line, "vertices"));
+        r.moves = uint64_t(jsonNumber(line, "moves"));
+        r.segments = uint64_t(jsonNumber(line, "segments"));
+        r.expandNsPerSymbol = jsonNumber(line, "expand_ns_per_symbol");
+        r.interpretVerticesPerSecond = jsonNumber(line, "interpret_vertices_per_s");
+        r.drawMs = jsonNumber(line, "draw_ms");
+        r.expandPeakBytes = size_t(jsonNumber(line, "expand_peak_bytes"));
+        r.renderPeakBytes = size_t(jsonNumber(line, "render_peak_bytes"));
+        results.push_back(r);
+    }
+    return results;
+}
+
+// Prints every metric worse than the baseline by more than threshold, returns their number
+int compareWithBaseline(const std::vector<BenchResult>& results, const std::vector<BenchResult>& baseline,
+                        double threshold) {
+    int regressions = 0;
+    auto check = [&](const BenchResult& r, const char* metric, double now, double was, bool isHigherBetter) {
+        if (was <= 0)
+            return;
+        double ratio = isHigherBetter ? was / std::max(now, 1e-12) : now / was;
+        if (ratio > 1 + threshold) {
+            ++regressions;
+            std::cout << "REGRESSION " << r.fractal << " gens " << r.gens << ": " << metric
+                      << " " << was << " -> " << now << std::endl;
+        }
+    };
+
+    for (const BenchResult& r : results) {
+        for (const BenchResult& b : baseline) {
+            if (b.fractal != r.fractal or b.gens != r.gens)
+                continue;
+            check(r, "expand_ns_per_symbol", r.expandNsPerSymbol, b.expandNsPerSymbol, false);
+            check(r, "interpret_vertices_per_s", r.interpretVerticesPerSecond, b.interpretVerticesPerSecond, true);
+            check(r, "draw_ms", r.drawMs, b.drawMs, false);
+            check(r, "expand_peak_bytes", double(r.expandPeakBytes), double(b.expandPeakBytes), false);
+            check(r, "render_peak_bytes", double(r.renderPeakBytes), double(b.renderPeakBytes), false);
+        }
+    }
+    return regressions;
+}
+
+// Builds the figure of lSystem serially (parts 1), in parallel or, with visibleArea set, in view,
+// colored by arc length, so that both the colors and the tags are compared
+void buildFigure(LSystem* lSystem, const std::string& fractal, int parts, const sf::FloatRect* visibleArea,
+                 float pixelSize, sf::VertexArray& figure, std::vector<VertexTag>& tags) {
+    Robot robot(fractal, 0, HEIGHT);
+    placeRobot(&robot, fractal, lSystem);
+    bool useMemory = usesMemory(fractal);
+    MacroStep whole = MacroSteps(lSystem, useMemory).compose(lSystem->getInitAxiom(), lSystem->getGens());
+    Coloring coloring(ColorMode::ArcLength, figureColor(fractal), whole.moves);
+
+    figure.clear();
+    tags.clear();
+    if (visibleArea != nullptr)
+        makeFigureInView(figure, lSystem, &robot, useMemory, *visibleArea, pixelSize, nullptr, &coloring, &tags);
+    else if (parts > 1)
+        makeFigureParallel(figure, lSystem, &robot, fractal, useMemory, parts, nullptr, &coloring, &tags);
+    else
+        makeFigureSerial(figure, lSystem, &robot, useMemory, nullptr, &coloring, &tags);
+}
+
+// Prints where two builds of a figure first differ, returns 1 when they do
+int compareFigures(const std::string& what, const sf::VertexArray& a, const std::vector<VertexTag>& aTags,
+                   const sf::VertexArray& b, const std::vector<VertexTag>& bTags) {
+    if (a.getVertexCount() != b.getVertexCount() or aTags.size() != bTags.size()) {
+        std::cout << "MISMATCH " << what << ": " << a.getVertexCount() << " vertices against "
+                  << b.getVertexCount() << std::endl;
+        return 1;
+    }
+    for (size_t i = 0; i < a.getVertexCount(); ++i) {
+        const VertexTag& x = aTags[i];
+        const VertexTag& y = bTags[i];
+        if (a[i].position != b[i].position or a[i].color != b[i].color or x.branch != y.branch or
+            x.arc != y.arc or x.depth != y.depth or x.heading != y.heading) {
+            std::cout << "MISMATCH " << what << ": vertex " << i << " (" << a[i].position.x << ", "
+                      << a[i].position.y << ") against (" << b[i].position.x << ", " << b[i].position.y << ")"
+                      << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The symbol of the expanded word that makes every step, by a walk over the whole word
+std::vector<uint64_t> symbolsOfSteps(LSystem* lSystem) {
+    std::vector<uint64_t> symbols;
+    LSystemStream stream(lSystem);
+    char c;
+    for (uint64_t symbol = 0; stream.next(c); ++symbol) {
+        if (lSystem->isDrawing(c))
+            symbols.push_back(symbol);
+    }
+    return symbols;
+}
+
+// Checks query() and pick() of an index of figure against scans of all its segments
+int verifyIndex(const std::string& what, const sf::VertexArray& figure) {
+    CompactFigure compact;
+    compact.set(figure, 0);
+    FigureIndex index;
+    index.build(compact);
+    std::vector<sf::Vertex> vertices(compact.getVertexCount());
+    compact.expand(0, vertices.size(), vertices.data());
+
+    std::mt19937 random(2021);
+    sf::FloatRect bounds = figure.getBounds();
+    std::uniform_real_distribution<float> randomX(bounds.left, bounds.left + bounds.width);
+    std::uniform_real_distribution<float> randomY(bounds.top, bounds.top + bounds.height);
+    int failures = 0;
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (int probe = 0; probe < 32; ++probe) {
+        sf::FloatRect area(randomX(random), randomY(random), bounds.width * float(probe % 4 + 1) / 32,
+                           bounds.height * float(probe % 4 + 1) / 32);
+        index.query(area, ranges);
+        std::vector<bool> isListed(vertices.size(), false);
+        for (const std::pair<size_t, size_t>& range : ranges) {
+            for (size_t i = range.first + 1; i < range.second; ++i) {
+                isListed[i] = true;
+            }
+        }
+        for (size_t i = 1; i < vertices.size(); ++i) {
+            const sf::Vector2f& a = vertices[i - 1].position;
+            const sf::Vector2f& b = vertices[i].position;
+            sf::FloatRect segment(std::min(a.x, b.x), std::min(a.y, b.y), std::fabs(a.x - b.x), std::fabs(a.y - b.y));
+            if (isSegmentEnd(figure.getPrimitiveType(), i) and isDrawn(vertices[i - 1], vertices[i]) and
+                touches(segment, area) and !isListed[i]) {
+                std::cout << "MISMATCH " << what << ": query misses the segment ending at vertex " << i << std::endl;
+                ++failures;
+                break;
+            }
+        }
+
+        float x = randomX(random), y = randomY(random), radius = bounds.width / 64;
+        size_t best = 0;
+        float bestDistance = radius;
+        for (size_t i = 1; i < vertices.size(); ++i) {
+            if (!isSegmentEnd(figure.getPrimitiveType(), i) or !isDrawn(vertices[i - 1], vertices[i]))
+                continue;
+            const sf::Vector2f& a = vertices[i - 1].position;
+            const sf::Vector2f& b = vertices[i].position;
+            float dx = b.x - a.x, dy = b.y - a.y, length = dx * dx + dy * dy;
+            float t = length > 0 ? std::min(1.f, std::max(0.f, ((x - a.x) * dx + (y - a.y) * dy) / length)) : 0;
+            float distance = std::hypot(a.x + t * dx - x, a.y + t * dy - y);
+            if (distance <= bestDistance) {
+                bestDistance = distance;
+                best = i;
+            }
+        }
+        size_t picked = index.pick(compact, x, y, radius);
+        if (picked != best) {
+            std::cout << "MISMATCH " << what << ": pick at (" << x << ", " << y << ") gives vertex " << picked
+                      << " instead of " << best << std::endl;
+            ++failures;
+        }
+    }
+    return failures;
+}
+
+// Pixels per side of the views culled builds are drawn in
+const unsigned VERIFY_VIEW_PIXELS = 200;
+
+// Lit pixels of a with no lit pixel of b at or next to them
+size_t unmatchedPixels(const std::vector<sf::Uint8>& a, const std::vector<sf::Uint8>& b, unsigned size) {
+    auto isLit = [&](const std::vector<sf::Uint8>& pixels, long x, long y) {
+        return x >= 0 and y >= 0 and x < long(size) and y < long(size) and pixels[(size_t(y) * size + size_t(x)) * 4 + 3] != 0;
+    };
+    size_t unmatched = 0;
+    for (long y = 0; y < long(size); ++y) {
+        for (long x = 0; x < long(size); ++x) {
+            if (!isLit(a, x, y))
+                continue;
+            bool isMatched = false;
+            for (long dy = -1; dy <= 1 and !isMatched; ++dy) {
+                for (long dx = -1; dx <= 1 and !isMatched; ++dx) {
+                    isMatched = isLit(b, x + dx, y + dy);
+                }
+            }
+            unmatched += !isMatched;
+        }
+    }
+    return unmatched;
+}
+
+// Builds the figure culled to view, at the detail of VERIFY_VIEW_PIXELS per side, and checks
+// that it draws what full draws there. A pruned subtree under a pixel is drawn as one segment,
+// so the two may differ by a pixel, but not by more.
+int verifyView(const std::string& what, LSystem* lSystem, const std::string& fractal, const sf::VertexArray& full,
+               const sf::FloatRect& view) {
+    double scale = std::max(view.width, view.height) / VERIFY_VIEW_PIXELS;
+    sf::VertexArray culled(sf::LinesStrip);
+    std::vector<VertexTag> tags;
+    buildFigure(lSystem, fractal, 1, &view, float(scale), culled, tags);
+
+    size_t bytes = size_t(VERIFY_VIEW_PIXELS) * VERIFY_VIEW_PIXELS * 4;
+    std::vector<sf::Uint8> fullPixels(bytes, 0), culledPixels(bytes, 0);
+    rasterizeStrip(full, view.left, view.top, scale, VERIFY_VIEW_PIXELS, VERIFY_VIEW_PIXELS, fullPixels);
+    rasterizeStrip(culled, view.left, view.top, scale, VERIFY_VIEW_PIXELS, VERIFY_VIEW_PIXELS, culledPixels);
+    size_t unmatched = unmatchedPixels(fullPixels, culledPixels, VERIFY_VIEW_PIXELS) +
+                       unmatchedPixels(culledPixels, fullPixels, VERIFY_VIEW_PIXELS);
+    if (unmatched == 0)
+        return 0;
+    std::cout << "MISMATCH " << what << ": the build culled to (" << view.left << ", " << view.top << ", "
+              << view.width << ", " << view.height << ") differs from the full one in " << unmatched << " pixels ("
+              << culled.getVertexCount() << " vertices)" << std::endl;
+    return 1;
+}
+
+// Checks a build with duplicate segments removed against the one it was made from: removed
+// segments are gone, no segment is left twice, the tags follow the vertices and the two draw
+// the same pixels
+int verifyDedup(const std::string& what, const sf::VertexArray& figure, const sf::VertexArray& deduped,
+                const std::vector<VertexTag>& dedupedTags, uint64_t removed) {
+    auto segmentsOf = [](const sf::VertexArray& strip) {
+        std::vector<std::tuple<int64_t, int64_t, int64_t, int64_t>> segments;
+        for (size_t i = 1; i < strip.getVertexCount(); ++i) {
+            if (!isSegmentEnd(strip.getPrimitiveType(), i) or !isDrawn(strip[i - 1], strip[i]))
+                continue;
+            SegmentKey key = segmentKey(strip[i - 1], strip[i]);
+            segments.emplace_back(key.x0, key.y0, key.x1, key.y1);
+        }
+        std::sort(segments.begin(), segments.end());
+        return segments;
+    };
+    auto segments = segmentsOf(figure), dedupedSegments = segmentsOf(deduped);
+    if (segments.size() - dedupedSegments.size() != removed or dedupedTags.size() != deduped.getVertexCount()) {
+        std::cout << "MISMATCH " << what << ": " << segments.size() << " segments, " << dedupedSegments.size()
+                  << " without duplicates, " << removed << " removed" << std::endl;
+        return 1;
+    }
+    if (std::adjacent_find(dedupedSegments.begin(), dedupedSegments.end()) != dedupedSegments.end()) {
+        std::cout << "MISMATCH " << what << ": a duplicate segment is left" << std::endl;
+        return 1;
+    }
+
+    sf::FloatRect bounds = figure.getBounds();
+    double scale = std::max(1e-9, double(std::max(bounds.width, bounds.height)) / VERIFY_VIEW_PIXELS);
+    size_t bytes = size_t(VERIFY_VIEW_PIXELS) * VERIFY_VIEW_PIXELS * 4;
+    std::vector<sf::Uint8> pixels(bytes, 0), dedupedPixels(bytes, 0);
+    rasterizeStrip(figure, bounds.left, bounds.top, scale, VERIFY_VIEW_PIXELS, VERIFY_VIEW_PIXELS, pixels);
+    rasterizeStrip(deduped, bounds.left, bounds.top, scale, VERIFY_VIEW_PIXELS, VERIFY_VIEW_PIXELS, dedupedPixels);
+    size_t unmatched = unmatchedPixels(pixels, dedupedPixels, VERIFY_VIEW_PIXELS) +
+                       unmatchedPixels(dedupedPixels, pixels, VERIFY_VIEW_PIXELS);
+    if (unmatched == 0)
+        return 0;
+    std::cout << "MISMATCH " << what << ": without duplicates it differs in " << unmatched << " pixels" << std::endl;
+    return 1;
+}
+
+// A stochastic figure has no serial and parallel builds to compare: its word comes from
+// GenerationCache, resumed from the closest generation cached. That word has to be the one
+// rewritten from the axiom, and the figure built again from the cached word the first one.
+int verifyStochastic(const std::string& fractal, int gens) {
+    std::string name = fractal + " gens " + std::to_string(gens);
+    int failures = 0;
+
+    StochasticLSystem* lSystem = createStochasticLSystem(fractal, gens, FOREST_SEED);
+    lSystem->generate();
+    std::shared_ptr<const std::vector<Module>> cached = stochasticWord(fractal, lSystem, gens);
+    const std::vector<Module>& word = lSystem->getWord();
+    bool isSame = cached != nullptr and cached->size() == word.size();
+    for (size_t i = 0; isSame and i < word.size(); ++i) {
+        isSame = (*cached)[i].symbol == word[i].symbol and (*cached)[i].length == word[i].length;
+    }
+    if (!isSame) {
+        std::cout << "MISMATCH " << name << ": the cached word differs from the one rewritten from the axiom"
+                  << std::endl;
+        ++failures;
+    }
+    delete lSystem;
+
+    sf::VertexArray figure(sf::LinesStrip), other(sf::LinesStrip);
+    std::vector<VertexTag> tags, otherTags;
+    FigureStats stats{};
+    makeFigure(figure, nullptr, nullptr, fractal, gens, nullptr, 0, nullptr, nullptr, ColorMode::ArcLength, &tags);
+    makeFigure(other, nullptr, nullptr, fractal, gens, nullptr, 0, nullptr, nullptr, ColorMode::ArcLength, &otherTags);
+    failures += compareFigures(name + ", from the cache", figure, tags, other, otherTags);
+    for (size_t i = 1; i < tags.size(); ++i) {
+        if (tags[i].arc < tags[i - 1].arc) {
+            std::cout << "MISMATCH " << name << ": the arc goes back at vertex " << i << std::endl;
+            ++failures;
+            break;
+        }
+    }
+
+    makeFigure(other, nullptr, nullptr, fractal, gens, nullptr, 0, &stats, nullptr, ColorMode::ArcLength, &otherTags,
+               true);
+    failures += verifyDedup(name + ", without duplicates", figure, other, otherTags, stats.duplicates);
+    failures += verifyIndex(name, figure);
+    return failures;
+}
+
+// Rewrites the Hogeweg plant, whose rules look at both neighbours of a symbol through
+// branches and ignored symbols, and compares its words with the ones worked out by hand
+int verifyContextRules() {
+    const std::vector<std::string> expected = {
+            "F1F0F1",
+            "F1F1F1F1",
+            "F1F0F0F1",
+            "F1F0F1[+F1F1]F1",
+            "F1F1F1F1[-F0F1]F1",
+            "F1F0F0F0[+F1F1F1]F1",
+            "F1F0F0F1[+F1F1][-F1F0F1]F1",
+    };
+    StochasticLSystem* lSystem = createStochasticLSystem("Hogeweg plant", int(expected.size()), FOREST_SEED);
+    int failures = 0;
+    for (int gen = 1; gen <= int(expected.size()); ++gen) {
+        lSystem->applyRules(gen);
+        std::string word;
+        for (const Module& module : lSystem->getWord()) {
+            word += module.symbol;
+        }
+        if (word != expected[gen - 1]) {
+            std::cout << "MISMATCH Hogeweg plant gens " << gen << ": " << word << " instead of "
+                      << expected[gen - 1] << std::endl;
+            ++failures;
+            break;
+        }
+    }
+    delete lSystem;
+    return failures;
+}
+
+// Runs every check on the built-in systems, returns the number of failures
+int verify() {
+    const std::vector<BenchCase> cases = {
+            {"Sierpinski triangle", 1, 8},
+            {"Koch's snowflake", 1, 5},
+            {"Plant", 1, 6},
+            {"Dragon curve", 1, 14},
+    };
+    // wide enough that nothing is pruned, so the in-view build has to be the full one
+    const sf::FloatRect everywhere(-1e9f, -1e9f, 2e9f, 2e9f);
+
+    int failures = 0;
+    for (const BenchCase& benchCase : cases) {
+        for (int gens = benchCase.minGens; gens <= benchCase.maxGens; ++gens) {
+            const std::string& fractal = benchCase.fractal;
+            std::string name = fractal + " gens " + std::to_string(gens);
+            LSystem* lSystem = createLSystem(fractal, gens);
+
+            sf::VertexArray serial(sf::LinesStrip), other(sf::LinesStrip);
+            std::vector<VertexTag> serialTags, otherTags;
+            buildFigure(lSystem, fractal, 1, nullptr, 0, serial, serialTags);
+            for (int parts : {2, 3, 4, 7}) {
+                buildFigure(lSystem, fractal, parts, nullptr, 0, other, otherTags);
+                failures += compareFigures(name + ", " + std::to_string(parts) + " parts", serial, serialTags,
+                                           other, otherTags);
+            }
+            buildFigure(lSystem, fractal, 1, &everywhere, 0, other, otherTags);
+            failures += compareFigures(name + ", in view", serial, serialTags, other, otherTags);
+
+            std::vector<uint64_t> symbols = symbolsOfSteps(lSystem);
+            if (serialTags.empty() or symbols.size() != serialTags.back().arc) {
+                std::cout << "MISMATCH " << name << ": the symbol walk makes " << symbols.size()
+                          << " steps, the last vertex comes after " << (serialTags.empty() ? 0 : serialTags.back().arc)
+                          << std::endl;
+                ++failures;
+            }
+            // every step of the small figures, about a thousand of the others
+            MacroSteps macroSteps(lSystem, usesMemory(fractal));
+            size_t stride = std::max<size_t>(1, symbols.size() / 1024);
+            for (size_t i = 0; i < symbols.size(); i += stride) {
+                uint64_t symbol = symbolOfStep(lSystem, macroSteps, i);
+                if (symbol != symbols[i]) {
+                    std::cout << "MISMATCH " << name << ": symbolOfStep(" << i << ") = " << symbol
+                              << " instead of " << symbols[i] << std::endl;
+                    ++failures;
+                    break;
+                }
+            }
+            // a vertex comes after the steps of the symbols before it
+            for (size_t i = 1; i < serialTags.size(); ++i) {
+                if (serialTags[i].arc < serialTags[i - 1].arc) {
+                    std::cout << "MISMATCH " << name << ": the arc goes back at vertex " << i << std::endl;
+                    ++failures;
+                    break;
+                }
+            }
+
+            failures += verifyIndex(name, serial);
+
+            sf::VertexArray deduped = serial;
+            std::vector<VertexTag> dedupedTags = serialTags;
+            size_t removed = removeDuplicateSegments(deduped, &dedupedTags);
+            failures += verifyDedup(name + ", without duplicates", serial, deduped, dedupedTags, removed);
+
+            // drawn as sf::Lines the figure has to draw the same pixels and index the same way
+            sf::VertexArray lines = serial;
+            uint64_t segments = choosePrimitive(lines);
+            if (lines.getPrimitiveType() == sf::Lines) {
+                sf::FloatRect bounds = serial.getBounds();
+                double scale = std::max(1e-9, double(std::max(bounds.width, bounds.height)) / VERIFY_VIEW_PIXELS);
+                std::vector<sf::Uint8> stripPixels, linesPixels;
+                rasterizeParallel(serial, bounds.left, bounds.top, scale, sf::Color::White, sf::Color::Black,
+                                  VERIFY_VIEW_PIXELS, VERIFY_VIEW_PIXELS, 2, stripPixels);
+                rasterizeParallel(lines, bounds.left, bounds.top, scale, sf::Color::White, sf::Color::Black,
+                                  VERIFY_VIEW_PIXELS, VERIFY_VIEW_PIXELS, 2, linesPixels);
+                if (lines.getVertexCount() != 2 * segments or stripPixels != linesPixels) {
+                    std::cout << "MISMATCH " << name << ": drawn as lines it differs from the strip" << std::endl;
+                    ++failures;
+                }
+                failures += verifyIndex(name + " as lines", lines);
+            }
+
+            std::mt19937 random{uint32_t(gens)};
+            sf::FloatRect bounds = serial.getBounds();
+            std::uniform_real_distribution<float> randomX(bounds.left, bounds.left + bounds.width);
+            std::uniform_real_distribution<float> randomY(bounds.top, bounds.top + bounds.height);
+            for (int zoom = 1; zoom <= 8; zoom *= 2) {
+                float size = std::max(bounds.width, bounds.height) / float(zoom);
+                sf::FloatRect view(randomX(random) - size / 2, randomY(random) - size / 2, size, size);
+                failures += verifyView(name, lSystem, fractal, serial, view);
+            }
+            delete lSystem;
+        }
+    }
+
+    const std::vector<BenchCase> stochasticCases = {
+            {"Forest", 1, 8},
+            {"Hogeweg plant", 1, 40},
+    };
+    for (const BenchCase& benchCase : stochasticCases) {
+        for (int gens = benchCase.minGens; gens <= benchCase.maxGens; ++gens) {
+            failures += verifyStochastic(benchCase.fractal, gens);
+        }
+    }
+
+    // A subtree pruned right before a long straight run: the run has to start where the subtree ends
+    LSystem tail("X" + std::string(200, 'F'), {{'X', "F-XF+F+F"}}, "F", 90, 6);
+    sf::VertexArray full(sf::LinesStrip);
+    std::vector<VertexTag> fullTags;
+    buildFigure(&tail, "Tail", 1, nullptr, 0, full, fullTags);
+    // a view on the run, a quarter of it away from the subtree and with two pixels per world unit
+    sf::Vector2f center = full[full.getVertexCount() - 1].position * 0.25f + full[0].position * 0.75f;
+    float size = float(VERIFY_VIEW_PIXELS) / 2;
+    failures += verifyView("Tail", &tail, "Tail", full, sf::FloatRect(center.x - size / 2, center.y - size / 2, size, size));
+
+    failures += verifyContextRules();
+
+    if (failures == 0)
+        std::cout << "All builds agree" << std::endl;
+    return failures;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 and std::string(argv[1]) == "--verify")
+        return verify() == 0 ? 0 : 1;
+
+    std::string jsonPath, baselinePath;
+    double threshold = 0.1;
+    int repeat = 3;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 < argc and arg == "--json") {
+            jsonPath = argv[++i];
+        } else if (i + 1 < argc and arg == "--baseline") {
+            baselinePath = argv[++i];
+        } else if (i + 1 < argc and arg == "--threshold") {
+            threshold = atof(argv[++i]);
+        } else if (i + 1 < argc and arg == "--repeat") {
+            repeat = std::max(1, atoi(argv[++i]));
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--json <file>] [--baseline <file>] [--threshold <ratio>] [--repeat <n>] | --verify"
+                      << std::endl;
+            return 2;
+        }
+    }
+
+    // the upper bounds are the largest generations menu() accepts
+    const std::vector<BenchCase> cases = {
+            {"Sierpinski triangle", 6, 14},
+            {"Koch's snowflake", 3, 10},
+            {"Plant", 3, 10},
+            {"Dragon curve", 10, 20},
+            {"Forest", 6, 12},
+            {"Hogeweg plant", 20, 40},
+    };
+
+    std::vector<BenchResult> results;
+    std::cout << std::left << std::setw(22) << "fractal" << std::setw(6) << "gens" << std::setw(14) << "symbols"
+              << std::setw(14) << "ns/symbol" << std::setw(16) << "vertices/s" << std::setw(14) << "steps/vertex"
+              << std::setw(18) << "vertices/segment"
+              << std::setw(12) << "draw ms"
+              << "peak MB (expand / render)" << std::endl;
+    for (const BenchCase& benchCase : cases) {
+        for (int gens = benchCase.minGens; gens <= benchCase.maxGens; ++gens) {
+            BenchResult r = runCase(benchCase.fractal, gens, repeat);
+            results.push_back(r);
+            std::cout << std::setw(22) << r.fractal << std::setw(6) << r.gens << std::setw(14) << r.symbols
+                      << std::setw(14) << std::setprecision(4) << r.expandNsPerSymbol
+                      << std::setw(16) << std::setprecision(4) << r.interpretVerticesPerSecond
+                      << std::setw(14) << std::setprecision(3) << double(r.moves) / double(std::max<uint64_t>(1, r.vertices))
+                      << std::setw(18) << std::setprecision(3) << double(r.vertices) / double(std::max<uint64_t>(1, r.segments))
+                      << std::setw(12) << std::setprecision(4) << r.drawMs
+                      << r.expandPeakBytes / 1048576.0 << " / " << r.renderPeakBytes / 1048576.0 << std::endl;
+        }
+    }
+
+    if (!jsonPath.empty()) {
+        std::ofstream out(jsonPath);
+        writeJson(out, results);
+    }
+
+    if (!baselinePath.empty()) {
+        std::vector<BenchResult> baseline = readBaseline(baselinePath);
+        if (baseline.empty()) {
+            std::cerr << "No cases in baseline " << baselinePath << std::endl;
+            return 2;
+        }
+        if (compareWithBaseline(results, baseline, threshold) > 0)
+            return 1;
+        std::cout << "No regressions against " << baselinePath << std::endl;
+    }
+    return 0;
+}
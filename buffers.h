@@ -0,0 +1,125 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_BUFFERS_H
+#define SPBU_SEMESTER1_FRACTALS_BUFFERS_H
+
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include "compact.h"
+
+// Vertices per GPU buffer, larger figures are split over several buffers
+const size_t VERTEX_BUFFER_CHUNK = 1 << 20;
+
+// Figure geometry uploaded once into static vertex buffers, so every redraw is just draw calls.
+// Without vertex buffer support the figure itself is drawn, as before.
+class StaticFigure : public sf::Drawable {
+private:
+    std::vector<sf::VertexBuffer*> buffers;
+    // first vertex of a buffer is its index times stride
+    size_t stride;
+    const sf::Drawable* fallback;
+    // vertex ranges of the strip to draw while isCulled, see setVisibleRanges()
+    bool isCulled;
+    std::vector<std::pair<size_t, size_t>> ranges;
+
+    void clear() {
+        for (sf::VertexBuffer* buffer : buffers) {
+            delete buffer;
+        }
+        buffers.clear();
+        fallback = nullptr;
+        showAll();
+    }
+
+    void draw(sf::RenderTarget& target, sf::RenderStates states) const override {
+        if (fallback != nullptr) {
+            target.draw(*fallback, states);
+            return;
+        }
+        for (size_t i = 0; i < buffers.size(); ++i) {
+            if (!isCulled) {
+                target.draw(*buffers[i], states);
+                continue;
+            }
+            size_t bufferBegin = i * stride, bufferEnd = bufferBegin + buffers[i]->getVertexCount();
+            for (const std::pair<size_t, size_t>& range : ranges) {
+                size_t begin = std::max(range.first, bufferBegin), end = std::min(range.second, bufferEnd);
+                if (end >= begin + 2)
+                    target.draw(*buffers[i], begin - bufferBegin, end - begin, states);
+            }
+        }
+    }
+
+    // Uploads vertexCount vertices, fill(buffer, begin, count) writes a chunk of them into its buffer.
+    // Without buffer support, or if an upload fails, figure is drawn instead.
+    template <typename Fill>
+    void upload(const sf::Drawable* figure, sf::PrimitiveType type, size_t vertexCount, Fill fill) {
+        clear();
+        if (!sf::VertexBuffer::isAvailable()) {
+            fallback = figure;
+            return;
+        }
+
+        // neighbouring chunks of a strip share a vertex, so no segment is lost at the seams
+        stride = type == sf::LinesStrip ? VERTEX_BUFFER_CHUNK - 1 : VERTEX_BUFFER_CHUNK;
+        for (size_t begin = 0; begin < vertexCount; begin += stride) {
+            size_t count = std::min(VERTEX_BUFFER_CHUNK, vertexCount - begin);
+            if (type == sf::LinesStrip and begin > 0 and count < 2)
+                break;
+
+            sf::VertexBuffer* buffer = new sf::VertexBuffer(type, sf::VertexBuffer::Static);
+            if (!buffer->create(count) or !fill(buffer, begin, count)) {
+                delete buffer;
+                clear();
+                fallback = figure;
+                return;
+            }
+            buffers.push_back(buffer);
+        }
+    }
+public:
+    StaticFigure() {
+        stride = VERTEX_BUFFER_CHUNK;
+        fallback = nullptr;
+        isCulled = false;
+    }
+
+    StaticFigure(const StaticFigure&) = delete;
+    StaticFigure& operator=(const StaticFigure&) = delete;
+
+    ~StaticFigure() { clear(); }
+
+    // Uploads a compact figure, expanding it batch by batch. The figure is only kept (and has to
+    // outlive this) without buffer support.
+    void set(const CompactFigure& figure) {
+        std::vector<sf::Vertex> batch;
+        upload(&figure, figure.getPrimitiveType(), figure.getVertexCount(),
+               [&](sf::VertexBuffer* buffer, size_t begin, size_t count) {
+            for (size_t offset = 0; offset < count; offset += COMPACT_BATCH) {
+                size_t n = std::min(COMPACT_BATCH, count - offset);
+                batch.resize(n);
+                figure.expand(begin + offset, n, batch.data());
+                if (!buffer->update(batch.data(), n, unsigned(offset)))
+                    return false;
+            }
+            return true;
+        });
+    }
+
+    // Draws only the given vertex ranges [begin, end) of the figure, as FigureIndex::query()
+    // finds them. Without buffer support the whole figure is still drawn.
+    void setVisibleRanges(const std::vector<std::pair<size_t, size_t>>& visibleRanges) {
+        isCulled = true;
+        ranges = visibleRanges;
+    }
+
+    void showAll() {
+        isCulled = false;
+        ranges.clear();
+    }
+
+    [[nodiscard]] size_t getBuffersNumber() const { return buffers.size(); }
+};
+
+#endif //SPBU_SEMESTER1_FRACTALS_BUFFERS_H
@@ -0,0 +1,152 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_BUILDER_H
+#define SPBU_SEMESTER1_FRACTALS_BUILDER_H
+
+#include <SFML/Graphics.hpp>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <algorithm>
+
+#include "parallel.h"
+#include "figure.h"
+#include "compact.h"
+#include "spatial.h"
+#include "cache.h"
+
+// Builds figures on a worker thread, so the window keeps drawing the previous one meanwhile.
+// A new request cancels the build in flight; a finished figure is handed over by poll().
+class FigureBuilder {
+private:
+    struct Build {
+        std::string robotName;
+        int gensNumber;
+        bool hasVisibleArea;
+        sf::FloatRect visibleArea;
+        float pixelSize;
+        ColorMode colorMode;
+        bool removeDuplicates;
+        BuildControl control;
+    };
+
+    std::mutex mutex;
+    // the latest request, nullptr when there is nothing to wait for
+    std::shared_ptr<Build> current;
+    bool isReady;
+    CompactFigure ready;
+    FigureIndex readyIndex;
+    MappedArray<VertexTag> readyTags;
+    FigureStats readyStats;
+    // destroyed first, after the destructor has cancelled the build it is running
+    ThreadPool pool;
+
+    void run(const std::shared_ptr<Build>& build) {
+        if (build->control.isCancelled)
+            return;
+
+        CompactFigure compact;
+        FigureIndex index;
+        MappedArray<VertexTag> tags;
+        FigureStats stats{};
+        // full builds are first drawn at one world unit per pixel
+        float maxError = (build->pixelSize > 0 ? build->pixelSize : 1) * COMPACT_MAX_ERROR;
+        // full builds come from the geometry cache when they were made before
+        uint64_t key = build->hasVisibleArea ? 0 : geometryKey(build->robotName, build->gensNumber,
+                                                               build->removeDuplicates);
+        std::shared_ptr<const CachedGeometry> cached = key != 0 ? geometryCache().get(key) : nullptr;
+        if (cached == nullptr or !loadGeometry(cached, build->robotName, build->colorMode, compact, tags, stats)) {
+            sf::VertexArray figure(sf::LinesStrip);
+            std::vector<VertexTag> builtTags;
+            makeFigure(figure, nullptr, nullptr, build->robotName, build->gensNumber,
+                       build->hasVisibleArea ? &build->visibleArea : nullptr, build->pixelSize, &stats,
+                       &build->control, build->colorMode, &builtTags, build->removeDuplicates);
+            if (build->control.isCancelled)
+                return;
+            compact.set(figure, maxError);
+            stats.vertexBytes = compact.getMemoryUsage();
+            // written to disk by the cache's own thread, this one goes on to hand the figure over
+            if (key != 0)
+                geometryCache().put(key, compact, builtTags, stats);
+            tags.take(std::move(builtTags));
+        }
+        index.build(compact);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (build != current or build->control.isCancelled)
+            return;
+        ready.swap(compact);
+        readyIndex.swap(index);
+        readyTags.swap(tags);
+        readyStats = stats;
+        isReady = true;
+    }
+public:
+    FigureBuilder() : pool(1) {
+        isReady = false;
+    }
+
+    ~FigureBuilder() { cancel(); }
+
+    void request(const std::string& robotName, int gensNumber, const sf::FloatRect* visibleArea = nullptr,
+                 float pixelSize = 0, ColorMode colorMode = ColorMode::Flat, bool removeDuplicates = false) {
+        std::shared_ptr<Build> build = std::make_shared<Build>();
+        build->robotName = robotName;
+        build->gensNumber = gensNumber;
+        build->hasVisibleArea = visibleArea != nullptr;
+        if (visibleArea != nullptr)
+            build->visibleArea = *visibleArea;
+        build->pixelSize = pixelSize;
+        build->colorMode = colorMode;
+        build->removeDuplicates = removeDuplicates;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (current != nullptr)
+            current->control.isCancelled = true;
+        current = build;
+        isReady = false;
+        pool.submit([this, build] { run(build); });
+    }
+
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (current != nullptr)
+            current->control.isCancelled = true;
+        current = nullptr;
+        isReady = false;
+    }
+
+    // Moves the finished figure, its spatial index and its vertex tags into `figure`, `index`
+    // and `tags` in one swap; false while there is none
+    bool poll(CompactFigure& figure, FigureIndex& index, MappedArray<VertexTag>& tags, FigureStats& stats) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!isReady)
+            return false;
+        figure.swap(ready);
+        index.swap(readyIndex);
+        tags.swap(readyTags);
+        ready.clear();
+        readyIndex.clear();
+        MappedArray<VertexTag>().swap(readyTags);
+        stats = readyStats;
+        isReady = false;
+        current = nullptr;
+        return true;
+    }
+
+    [[nodiscard]] bool isBuilding() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return current != nullptr and !isReady;
+    }
+
+    // Done part of the build from 0 to 1, or -1 when it can't be told (culled builds, and stochastic
+    // ones while their word is rewritten)
+    [[nodiscard]] float getProgress() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (current == nullptr or current->control.total == 0)
+            return -1;
+        return std::min(1.f, float(current->control.done) / float(current->control.total));
+    }
+};
+
+#endif //SPBU_SEMESTER1_FRACTALS_BUILDER_H
@@ -0,0 +1,362 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_CACHE_H
+#define SPBU_SEMESTER1_FRACTALS_CACHE_H
+
+#include <SFML/Graphics.hpp>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#include "settings.h"
+#include "coloring.h"
+#include "figure.h"
+#include "parallel.h"
+#include "compact.h"
+#include "lru.h"
+
+// Bumped whenever the file layout or what a figure is built like changes, old files are then ignored
+const uint32_t GEOMETRY_CACHE_VERSION = 4;
+// Figures with more vertices are not written to disk
+const uint64_t GEOMETRY_CACHE_MAX_VERTICES = uint64_t(64) << 20;
+
+// A cache file is this header, the arrays of the compact figure as CompactFigure::write() lays
+// them out and the vertex tags, all in the byte order of the machine that wrote it. Loading one
+// maps it and reads the arrays and the tags where they are.
+struct GeometryHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t tagBytes;
+    uint64_t key;
+    uint64_t vertexCount;
+    // sf::Lines or sf::LinesStrip, see choosePrimitive()
+    uint64_t primitive;
+    uint64_t symbols, steps, moves, duplicates, segments;
+    // what the colors in the file are colored by, other modes recolor them from the tags
+    uint64_t colorMode;
+    CompactCounts counts;
+};
+
+const char GEOMETRY_MAGIC[8] = {'L', 'S', 'Y', 'S', 'G', 'E', 'O', 0};
+
+// Key of the full build of a figure: a hash of everything its geometry follows from, 0 for
+// the figures that aren't cached (the stochastic ones)
+inline uint64_t geometryKey(const std::string& robotName, int gensNumber, bool removeDuplicates) {
+    LSystem* lSystem = createLSystem(robotName, gensNumber);
+    if (lSystem == nullptr)
+        return 0;
+
+    // FNV-1a
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    auto add = [&](const void* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast<const unsigned char*>(data)[i]) * 0x100000001B3ULL;
+        }
+    };
+    auto addInt = [&](int64_t value) { add(&value, sizeof(value)); };
+
+    addInt(GEOMETRY_CACHE_VERSION);
+    addInt(int64_t(lSystem->getInitAxiom().size()));
+    add(lSystem->getInitAxiom().data(), lSystem->getInitAxiom().size());
+    for (int c = 0; c < 256; ++c) {
+        const std::string* rule = lSystem->getRule(char(c));
+        addInt(lSystem->isDrawing(char(c)));
+        addInt(rule == nullptr ? -1 : int64_t(rule->size()));
+        if (rule != nullptr)
+            add(rule->data(), rule->size());
+    }
+    addInt(lSystem->getAngle());
+    addInt(step);
+    addInt(gensNumber);
+    addInt(startAngle(robotName));
+    addInt(usesMemory(robotName));
+    addInt(HEIGHT);
+    addInt(removeDuplicates);
+    delete lSystem;
+    return hash == 0 ? 1 : hash;
+}
+
+// A cache file mapped into memory, read in place
+class CachedGeometry {
+private:
+    void* data;
+    size_t bytes;
+public:
+    CachedGeometry(void* _data, size_t _bytes) {
+        data = _data;
+        bytes = _bytes;
+    }
+
+    CachedGeometry(const CachedGeometry&) = delete;
+    CachedGeometry& operator=(const CachedGeometry&) = delete;
+
+    ~CachedGeometry() { munmap(data, bytes); }
+
+    [[nodiscard]] const GeometryHeader& getHeader() const { return *static_cast<const GeometryHeader*>(data); }
+    // The arrays for CompactFigure::map()
+    [[nodiscard]] const char* getArrays() const { return static_cast<const char*>(data) + sizeof(GeometryHeader); }
+    [[nodiscard]] const VertexTag* getTags() const {
+        return reinterpret_cast<const VertexTag*>(getArrays() + CompactFigure::getWrittenBytes(getHeader().counts));
+    }
+    [[nodiscard]] size_t getBytes() const { return bytes; }
+};
+
+// Full builds of figures kept on disk between runs, one file per key, and mapped with mmap, so
+// loading one is no more than paging it in. Up to byteBudget bytes of files stay mapped between
+// builds and up to diskBudget bytes of them stay on disk, the least recently used ones go
+// first. Files are written by a thread of their own, after the build has been handed over.
+class GeometryCache {
+private:
+    typedef std::shared_ptr<const CachedGeometry> Geometry;
+
+    struct PendingWrite {
+        uint64_t key;
+        CompactFigure figure;
+        std::vector<VertexTag> tags;
+        FigureStats stats;
+    };
+
+    std::string directory;
+    uint64_t diskBudget;
+    std::mutex mutex;
+    // files still in use stay mapped through their shared pointers
+    LruCache<uint64_t, Geometry> mapped;
+    // builds finished while another one is being written aren't cached
+    bool isWriting;
+    // destroyed first, after the file being written is done
+    ThreadPool writer;
+
+    [[nodiscard]] std::string pathOf(uint64_t key) const {
+        char name[32];
+        snprintf(name, sizeof(name), "/%016llx.geo", (unsigned long long)key);
+        return directory + name;
+    }
+
+    // The file of key mapped, or nullptr when there is none or it doesn't check out
+    Geometry mapFile(uint64_t key) const {
+        int file = open(pathOf(key).c_str(), O_RDONLY);
+        if (file < 0)
+            return nullptr;
+        struct stat status{};
+        void* data = MAP_FAILED;
+        if (fstat(file, &status) == 0 and size_t(status.st_size) >= sizeof(GeometryHeader))
+            data = mmap(nullptr, size_t(status.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+        close(file);
+        if (data == MAP_FAILED)
+            return nullptr;
+
+        Geometry geometry = std::make_shared<const CachedGeometry>(data, size_t(status.st_size));
+        const GeometryHeader& header = geometry->getHeader();
+        const CompactCounts& counts = header.counts;
+        // no array has more elements than there are vertices, so the sizes below can't overflow
+        uint64_t most = header.vertexCount;
+        if (memcmp(header.magic, GEOMETRY_MAGIC, sizeof(GEOMETRY_MAGIC)) != 0 or
+            header.version != GEOMETRY_CACHE_VERSION or header.tagBytes != sizeof(VertexTag) or header.key != key or
+            header.vertexCount > GEOMETRY_CACHE_MAX_VERTICES or
+            (header.primitive != sf::Lines and header.primitive != sf::LinesStrip) or
+            counts.chunks > most or counts.fixed > most or counts.floats > most or counts.palette > most or
+            counts.indices > most or counts.rawColors > most or
+            geometry->getBytes() != sizeof(GeometryHeader) + CompactFigure::getWrittenBytes(counts) +
+                                    header.vertexCount * sizeof(VertexTag))
+            return nullptr;
+        return geometry;
+    }
+
+    // Writes the file of a build; it is renamed into place once complete, so a run that stops
+    // halfway leaves no broken file behind. False when it couldn't be written.
+    bool writeFile(const PendingWrite& pending) const {
+        const CompactFigure& figure = pending.figure;
+        uint64_t vertexCount = figure.getVertexCount();
+        GeometryHeader header{};
+        memcpy(header.magic, GEOMETRY_MAGIC, sizeof(GEOMETRY_MAGIC));
+        header.version = GEOMETRY_CACHE_VERSION;
+        header.tagBytes = sizeof(VertexTag);
+        header.key = pending.key;
+        header.vertexCount = vertexCount;
+        header.primitive = figure.getPrimitiveType();
+        header.symbols = pending.stats.symbols;
+        header.steps = pending.stats.steps;
+        header.moves = pending.stats.moves;
+        header.duplicates = pending.stats.duplicates;
+        header.segments = pending.stats.segments;
+        header.colorMode = uint64_t(pending.stats.colorMode);
+        header.counts = figure.getCounts();
+
+        mkdir(directory.c_str(), 0755);
+        std::string path = pathOf(pending.key), temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            figure.write([&](const void* data, size_t bytes) {
+                out.write(static_cast<const char*>(data), std::streamsize(bytes));
+            });
+            out.write(reinterpret_cast<const char*>(pending.tags.data()),
+                      std::streamsize(pending.tags.size() * sizeof(VertexTag)));
+            if (!out) {
+                out.close();
+                std::remove(temporary.c_str());
+                return false;
+            }
+        }
+        if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Deletes the least recently used files of the directory until the rest fits diskBudget.
+    // A file is used when it is written or mapped, see get(); kept, the one just written, stays.
+    void trimDisk(const std::string& kept) const {
+        DIR* dir = opendir(directory.c_str());
+        if (dir == nullptr)
+            return;
+        struct File {
+            time_t used;
+            uint64_t bytes;
+            std::string path;
+        };
+        std::vector<File> files;
+        uint64_t total = 0;
+        for (dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name.size() < 4 or name.compare(name.size() - 4, 4, ".geo") != 0)
+                continue;
+            std::string path = directory + "/" + name;
+            struct stat status{};
+            if (stat(path.c_str(), &status) != 0)
+                continue;
+            total += uint64_t(status.st_size);
+            if (path != kept)
+                files.push_back(File{status.st_mtime, uint64_t(status.st_size), path});
+        }
+        closedir(dir);
+
+        std::sort(files.begin(), files.end(), [](const File& a, const File& b) { return a.used < b.used; });
+        // mappings of deleted files stay valid until they are unmapped
+        for (size_t i = 0; i < files.size() and total > diskBudget; ++i) {
+            if (std::remove(files[i].path.c_str()) == 0)
+                total -= files[i].bytes;
+        }
+    }
+
+    void write(const PendingWrite& pending) {
+        Geometry geometry;
+        if (writeFile(pending)) {
+            trimDisk(pathOf(pending.key));
+            geometry = mapFile(pending.key);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        isWriting = false;
+        // a newer build of the key replaces the mapping of the older one
+        mapped.erase(pending.key);
+        if (geometry != nullptr) {
+            mapped.insert(pending.key, geometry, geometry->getBytes());
+            mapped.trim();
+        }
+    }
+public:
+    GeometryCache(const std::string& _directory, size_t _byteBudget, uint64_t _diskBudget)
+            : mapped(_byteBudget), writer(1) {
+        directory = _directory;
+        diskBudget = _diskBudget;
+        isWriting = false;
+    }
+
+    // The cached figure of key, nullptr when there is none
+    Geometry get(uint64_t key) {
+        Geometry geometry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Geometry* found = mapped.use(key);
+            if (found != nullptr)
+                geometry = *found;
+        }
+        if (geometry == nullptr) {
+            geometry = mapFile(key);
+            if (geometry == nullptr)
+                return nullptr;
+            std::lock_guard<std::mutex> lock(mutex);
+            mapped.insert(key, geometry, geometry->getBytes());
+            mapped.trim();
+        }
+        // the time of the last use, files unused the longest are deleted first
+        utimensat(AT_FDCWD, pathOf(key).c_str(), nullptr, 0);
+        return geometry;
+    }
+
+    // Hands a copy of the full build of a figure with its tags over to the writer thread. Nothing
+    // waits for the file; until it is there, get() misses the key.
+    void put(uint64_t key, const CompactFigure& figure, const std::vector<VertexTag>& tags, const FigureStats& stats) {
+        uint64_t vertexCount = figure.getVertexCount();
+        if (key == 0 or vertexCount > GEOMETRY_CACHE_MAX_VERTICES or tags.size() != vertexCount)
+            return;
+        // a file over the whole disk budget would only push everything else out
+        if (sizeof(GeometryHeader) + CompactFigure::getWrittenBytes(figure.getCounts()) +
+            vertexCount * sizeof(VertexTag) > diskBudget)
+            return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (isWriting)
+                return;
+            isWriting = true;
+        }
+        std::shared_ptr<PendingWrite> pending =
+                std::make_shared<PendingWrite>(PendingWrite{key, figure, tags, stats});
+        writer.submit([this, pending] { write(*pending); });
+    }
+
+    [[nodiscard]] size_t getBytesUsed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return mapped.getBytesUsed();
+    }
+};
+
+inline GeometryCache& geometryCache() {
+    static GeometryCache cache(GEOMETRY_CACHE_DIRECTORY, GEOMETRY_CACHE_BYTES, GEOMETRY_CACHE_DISK_BYTES);
+    return cache;
+}
+
+// Points figure and tags into a cached build, which they keep mapped, and fills stats with what
+// the build had. Only the colors are made anew, when colorMode isn't the one the file was
+// written in. False when the file doesn't hold a figure after all.
+inline bool loadGeometry(const std::shared_ptr<const CachedGeometry>& geometry, const std::string& robotName,
+                         ColorMode colorMode, CompactFigure& figure, MappedArray<VertexTag>& tags, FigureStats& stats) {
+    auto start = std::chrono::steady_clock::now();
+    const GeometryHeader& header = geometry->getHeader();
+    size_t vertexCount = header.vertexCount;
+    bool withColors = header.colorMode == uint64_t(colorMode);
+    if (!figure.map(sf::PrimitiveType(header.primitive), vertexCount, header.counts, geometry->getArrays(), withColors,
+                    geometry))
+        return false;
+    tags.map(geometry->getTags(), vertexCount, geometry);
+    if (!withColors)
+        figure.recolor(tags.data(), tags.size(), Coloring(colorMode, figureColor(robotName), header.steps));
+
+    stats = FigureStats{};
+    stats.isCached = true;
+    stats.colorMode = colorMode;
+    stats.setupMs = millisecondsSince(start);
+    stats.symbols = header.symbols;
+    stats.vertices = vertexCount;
+    stats.steps = header.steps;
+    stats.moves = header.moves;
+    stats.duplicates = header.duplicates;
+    stats.segments = header.segments;
+    stats.primitive = sf::PrimitiveType(header.primitive);
+    stats.vertexBytes = figure.getMemoryUsage();
+    return true;
+}
+
+#endif //SPBU_SEMESTER1_FRACTALS_CACHE_H
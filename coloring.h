@@ -0,0 +1,128 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_COLORING_H
+#define SPBU_SEMESTER1_FRACTALS_COLORING_H
+
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include "settings.h"
+#include "robot.h"
+
+enum class ColorMode {
+    Flat,       // one color for the whole figure
+    Depth,      // lighter with every nested branch
+    ArcLength,  // rainbow from the first step of the figure to the last
+    Branch,     // every branch in a color of its own
+    Heading,    // by the direction of the step
+};
+
+const int COLOR_MODES_NUMBER = 5;
+
+// What the coloring modes need to know about a vertex. Kept next to the figure,
+// it lets the figure be recolored without being built again.
+struct VertexTag {
+    // steps walked from the start of the figure before the vertex, see Robot::getSteps()
+    uint64_t arc;
+    uint32_t branch;
+    uint16_t depth;
+    // degrees in [0, 360), HIDDEN_HEADING for the transparent vertices of a jump between branches
+    uint16_t heading;
+};
+
+const uint16_t HIDDEN_HEADING = 0xFFFF;
+
+// Id of the branch the robot is in: a hash of the state it had at the '[' that opened it.
+// Coordinates are rounded, so the serial and the parallel walks agree on it.
+inline uint32_t branchId(const RobotData& start) {
+    uint64_t x = uint64_t(int64_t(std::lround(start.x * 16))) * 0x9E3779B97F4A7C15ULL;
+    x ^= uint64_t(int64_t(std::lround(start.y * 16))) * 0xC2B2AE3D27D4EB4FULL;
+    x ^= uint64_t(int64_t(std::lround(start.angle))) * 0x165667B19E3779F9ULL;
+    x ^= x >> 29;
+    return uint32_t(x ^ (x >> 32));
+}
+
+// Tag of the vertex the robot is standing on. outerDepth and outerBranch describe the
+// branches opened before the robot's memory starts, as for a piece walked on its own.
+inline VertexTag tagOf(const Robot* robot, uint16_t outerDepth = 0, uint32_t outerBranch = 0) {
+    std::stack<RobotData>* memory = robot->getMemory();
+    int heading = robot->hasIntegerAngle() ? robot->getHeading()
+                                           : (int(std::floor(robot->getAngle())) % 360 + 360) % 360;
+    return {robot->getSteps(), memory->empty() ? outerBranch : branchId(memory->top()),
+            uint16_t(outerDepth + memory->size()), uint16_t(heading)};
+}
+
+// Colors vertices from their tags through a 256-entry palette. Emitting code calls color()
+// for every vertex it writes, so no separate coloring pass over the figure is needed.
+class Coloring {
+private:
+    ColorMode mode;
+    std::array<sf::Color, 256> palette;
+    // steps of the whole figure, the end of the arc-length gradient
+    uint64_t steps;
+
+    static sf::Color hueColor(double hue) {
+        double h = std::fmod(hue, 360) / 60;
+        double x = 1 - std::fabs(std::fmod(h, 2) - 1);
+        double r = 0, g = 0, b = 0;
+        if (h < 1) {
+            r = 1, g = x;
+        } else if (h < 2) {
+            r = x, g = 1;
+        } else if (h < 3) {
+            g = 1, b = x;
+        } else if (h < 4) {
+            g = x, b = 1;
+        } else if (h < 5) {
+            r = x, b = 1;
+        } else {
+            r = 1, b = x;
+        }
+        return sf::Color(sf::Uint8(55 + 200 * r), sf::Uint8(55 + 200 * g), sf::Uint8(55 + 200 * b));
+    }
+public:
+    Coloring(ColorMode _mode, sf::Color base, uint64_t _steps) {
+        mode = _mode;
+        steps = std::max<uint64_t>(1, _steps);
+        for (int i = 0; i < 256; ++i) {
+            if (mode == ColorMode::Flat) {
+                palette[i] = base;
+            } else if (mode == ColorMode::Depth) {
+                // from the base color at the trunk towards white
+                int k = std::min(i, 15);
+                palette[i] = sf::Color(sf::Uint8(base.r + (255 - base.r) * k / 20),
+                                       sf::Uint8(base.g + (255 - base.g) * k / 20),
+                                       sf::Uint8(base.b + (255 - base.b) * k / 20));
+            } else {
+                palette[i] = hueColor(i * 360.0 / 256);
+            }
+        }
+    }
+
+    [[nodiscard]] uint8_t index(const VertexTag& tag) const {
+        switch (mode) {
+            case ColorMode::Flat:
+                return 0;
+            case ColorMode::Depth:
+                return uint8_t(std::min<int>(tag.depth, 255));
+            case ColorMode::ArcLength:
+                return uint8_t(std::min<double>(255, double(tag.arc) * 256 / double(steps)));
+            case ColorMode::Branch:
+                return uint8_t(tag.branch);
+            case ColorMode::Heading:
+                return uint8_t(tag.heading * 256 / 360);
+        }
+        return 0;
+    }
+
+    [[nodiscard]] sf::Color color(const VertexTag& tag) const {
+        return tag.heading == HIDDEN_HEADING ? sf::Color::Transparent : palette[index(tag)];
+    }
+    [[nodiscard]] sf::Color paletteColor(uint8_t i) const { return palette[i]; }
+
+    [[nodiscard]] ColorMode getMode() const { return mode; }
+};
+
+#endif //SPBU_SEMESTER1_FRACTALS_COLORING_H
@@ -0,0 +1,510 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_COMPACT_H
+#define SPBU_SEMESTER1_FRACTALS_COMPACT_H
+
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+#include <cstdint>
+#include <cmath>
+
+#include "coloring.h"
+
+// Vertices per chunk of a CompactFigure, every chunk has its own origin and colors
+const size_t COMPACT_CHUNK = 1 << 12;
+// Vertices expanded for one draw call
+const size_t COMPACT_BATCH = 1 << 16;
+// Largest quantization error of a position, in pixels of the view the figure was built for
+const float COMPACT_MAX_ERROR = 0.125f;
+// Arrays written by CompactFigure::write() start at multiples of this, which fits every element
+const size_t COMPACT_ALIGNMENT = 8;
+
+inline size_t compactAligned(size_t bytes) {
+    return (bytes + COMPACT_ALIGNMENT - 1) / COMPACT_ALIGNMENT * COMPACT_ALIGNMENT;
+}
+
+// Elements held in a vector of their own, or read in place from memory that mapping keeps
+// alive, such as a mapped cache file. Changing a mapped array first makes it an empty held one.
+template <typename T>
+class MappedArray {
+private:
+    std::vector<T> held;
+    std::shared_ptr<const void> mapping;
+    // held.data() unless the array is mapped
+    const T* items;
+    size_t count;
+
+    void sync() {
+        items = held.data();
+        count = held.size();
+    }
+
+    void hold() {
+        if (mapping == nullptr)
+            return;
+        mapping.reset();
+        sync();
+    }
+public:
+    MappedArray() {
+        items = nullptr;
+        count = 0;
+    }
+
+    MappedArray(const MappedArray& other) : held(other.held), mapping(other.mapping) {
+        sync();
+        if (mapping != nullptr) {
+            items = other.items;
+            count = other.count;
+        }
+    }
+
+    MappedArray& operator=(const MappedArray& other) {
+        MappedArray copy(other);
+        swap(copy);
+        return *this;
+    }
+
+    // Reads _count elements at _items, which stay valid as long as _mapping is held
+    void map(const T* _items, size_t _count, std::shared_ptr<const void> _mapping) {
+        std::vector<T>().swap(held);
+        mapping = std::move(_mapping);
+        items = _items;
+        count = _count;
+    }
+
+    // Holds the elements of vector, which is left empty
+    void take(std::vector<T>&& vector) {
+        mapping.reset();
+        held.clear();
+        held.swap(vector);
+        sync();
+    }
+
+    void push_back(const T& item) {
+        hold();
+        held.push_back(item);
+        sync();
+    }
+
+    void append(const T* first, const T* last) {
+        hold();
+        held.insert(held.end(), first, last);
+        sync();
+    }
+
+    void resize(size_t size) {
+        hold();
+        held.resize(size);
+        sync();
+    }
+
+    void clear() {
+        mapping.reset();
+        held.clear();
+        sync();
+    }
+
+    void shrink_to_fit() {
+        held.shrink_to_fit();
+        if (mapping == nullptr)
+            sync();
+    }
+
+    void swap(MappedArray& other) {
+        held.swap(other.held);
+        mapping.swap(other.mapping);
+        std::swap(items, other.items);
+        std::swap(count, other.count);
+    }
+
+    const T& operator[](size_t i) const { return items[i]; }
+    [[nodiscard]] const T* data() const { return items; }
+    [[nodiscard]] size_t size() const { return count; }
+    [[nodiscard]] bool empty() const { return count == 0; }
+    // Bytes held, mapped elements are pages of the memory they are read from
+    [[nodiscard]] size_t getHeldBytes() const { return held.capacity() * sizeof(T); }
+};
+
+// Element counts of the arrays of a CompactFigure, for a file that keeps them as they are
+struct CompactCounts {
+    uint64_t chunks, fixed, floats, palette, indices, rawColors;
+};
+
+// Figure geometry in a few bytes per vertex instead of the 20 of sf::Vertex, which also
+// carries texture coordinates that are never used. Positions are kept as separate x and y
+// arrays, as 16-bit offsets from the chunk origin where that is precise enough, and colors
+// as one color per chunk or as indices into a small palette of the chunk. Drawing expands
+// the vertices into a buffer of COMPACT_BATCH vertices, one batch at a time.
+// The arrays can be written out with write() and read back in place with map(), so a
+// figure loaded from the geometry cache is neither copied nor encoded again.
+class CompactFigure : public sf::Drawable {
+private:
+    struct Chunk {
+        sf::Vector2f origin;
+        // world units per fixed-point step, 0 when the positions are kept as floats
+        float unit;
+        // into fixedX and fixedY, or into floatX and floatY
+        uint64_t positions;
+    };
+
+    // Kept apart from Chunk, so that recoloring a mapped figure leaves its positions mapped
+    struct ChunkColors {
+        // palette entries of the chunk: one is a uniform color, none means raw colors
+        uint64_t paletteBegin, paletteSize;
+        // into indices or into rawColors
+        uint64_t colors;
+    };
+
+    sf::PrimitiveType type;
+    size_t vertexCount;
+    MappedArray<Chunk> chunks;
+    MappedArray<uint16_t> fixedX, fixedY;
+    MappedArray<float> floatX, floatY;
+    MappedArray<ChunkColors> chunkColors;
+    MappedArray<sf::Color> palette;
+    MappedArray<uint8_t> indices;
+    // chunks with more than 256 colors, only small figures in a gradient get there
+    MappedArray<sf::Color> rawColors;
+    mutable std::vector<sf::Vertex> batch;
+
+    void clearColors() {
+        chunkColors.clear();
+        palette.clear();
+        indices.clear();
+        rawColors.clear();
+    }
+
+    void encodeColors(const sf::Color* colors, size_t count) {
+        ChunkColors chunk{};
+        // palette index of every color met in the chunk, by an open addressing table
+        const size_t TABLE_SIZE = 512;
+        uint32_t keys[TABLE_SIZE];
+        int16_t values[TABLE_SIZE];
+        std::fill(values, values + TABLE_SIZE, -1);
+
+        chunk.paletteBegin = palette.size();
+        chunk.colors = indices.size();
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t key = colors[i].toInteger();
+            size_t slot = (key * 0x9E3779B1u) >> 23;
+            while (values[slot] >= 0 and keys[slot] != key) {
+                slot = (slot + 1) % TABLE_SIZE;
+            }
+            if (values[slot] < 0) {
+                if (palette.size() - chunk.paletteBegin == 256) {
+                    palette.resize(chunk.paletteBegin);
+                    indices.resize(chunk.colors);
+                    chunk.paletteSize = 0;
+                    chunk.colors = rawColors.size();
+                    rawColors.append(colors, colors + count);
+                    chunkColors.push_back(chunk);
+                    return;
+                }
+                keys[slot] = key;
+                values[slot] = int16_t(palette.size() - chunk.paletteBegin);
+                palette.push_back(colors[i]);
+            }
+            indices.push_back(uint8_t(values[slot]));
+        }
+        chunk.paletteSize = palette.size() - chunk.paletteBegin;
+        // a uniform chunk needs no indices
+        if (chunk.paletteSize == 1)
+            indices.resize(chunk.colors);
+        chunkColors.push_back(chunk);
+    }
+
+    void shrink() {
+        chunks.shrink_to_fit();
+        chunkColors.shrink_to_fit();
+        fixedX.shrink_to_fit();
+        fixedY.shrink_to_fit();
+        floatX.shrink_to_fit();
+        floatY.shrink_to_fit();
+        palette.shrink_to_fit();
+        indices.shrink_to_fit();
+        rawColors.shrink_to_fit();
+    }
+
+    // position(i) is the position of vertex i of the figure
+    template <typename Position>
+    void encodePositions(Chunk& chunk, Position position, size_t begin, size_t count, float maxError) {
+        sf::Vector2f first = position(begin);
+        float minX = first.x, minY = first.y, maxX = minX, maxY = minY;
+        for (size_t i = begin; i < begin + count; ++i) {
+            sf::Vector2f point = position(i);
+            minX = std::min(minX, point.x);
+            minY = std::min(minY, point.y);
+            maxX = std::max(maxX, point.x);
+            maxY = std::max(maxY, point.y);
+        }
+        chunk.origin = sf::Vector2f(minX, minY);
+        // rounding to the nearest step is off by half a step at most
+        chunk.unit = std::max(std::max(maxX - minX, maxY - minY) / 65535, 1e-6f);
+        if (chunk.unit > 2 * maxError) {
+            chunk.unit = 0;
+            chunk.positions = floatX.size();
+            for (size_t i = begin; i < begin + count; ++i) {
+                sf::Vector2f point = position(i);
+                floatX.push_back(point.x);
+                floatY.push_back(point.y);
+            }
+            return;
+        }
+        chunk.positions = fixedX.size();
+        for (size_t i = begin; i < begin + count; ++i) {
+            sf::Vector2f point = position(i);
+            fixedX.push_back(uint16_t(std::lround((point.x - minX) / chunk.unit)));
+            fixedY.push_back(uint16_t(std::lround((point.y - minY) / chunk.unit)));
+        }
+    }
+
+    // Takes the positions of the vertices, the chunks are left without colors
+    template <typename Position>
+    void setPositions(sf::PrimitiveType _type, size_t _vertexCount, Position position, float maxError) {
+        clear();
+        type = _type;
+        vertexCount = _vertexCount;
+        for (size_t begin = 0; begin < vertexCount; begin += COMPACT_CHUNK) {
+            Chunk chunk{};
+            encodePositions(chunk, position, begin, std::min(COMPACT_CHUNK, vertexCount - begin), maxError);
+            chunks.push_back(chunk);
+        }
+    }
+
+    void draw(sf::RenderTarget& target, sf::RenderStates states) const override {
+        // neighbouring batches of a strip share a vertex, so no segment is lost at the seams
+        size_t stride = type == sf::LinesStrip ? COMPACT_BATCH - 1 : COMPACT_BATCH;
+        batch.resize(std::min(COMPACT_BATCH, vertexCount));
+        for (size_t begin = 0; begin < vertexCount; begin += stride) {
+            size_t count = std::min(COMPACT_BATCH, vertexCount - begin);
+            if (type == sf::LinesStrip and begin > 0 and count < 2)
+                break;
+            expand(begin, count, batch.data());
+            target.draw(batch.data(), count, type, states);
+        }
+    }
+public:
+    CompactFigure() {
+        type = sf::LinesStrip;
+        vertexCount = 0;
+    }
+
+    // Takes the geometry of the figure. Positions are quantized in the chunks where the error
+    // stays within maxError world units; with maxError = 0 all of them are kept as floats.
+    void set(const sf::VertexArray& figure, float maxError) {
+        setPositions(figure.getPrimitiveType(), figure.getVertexCount(),
+                     [&](size_t i) { return figure[i].position; }, maxError);
+        std::vector<sf::Color> colors;
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            size_t begin = i * COMPACT_CHUNK, count = std::min(COMPACT_CHUNK, vertexCount - begin);
+            colors.resize(count);
+            for (size_t k = 0; k < count; ++k) {
+                colors[k] = figure[begin + k].color;
+            }
+            encodeColors(colors.data(), count);
+        }
+        shrink();
+    }
+
+    // Colors the figure anew from the tags it was built with, tagCount of them at tags; the
+    // positions stay. The palette index of every vertex of a chunk is found first, in a loop over
+    // the tags alone, and the chunk palette is then made of the entries met, looked up by index,
+    // so no color is hashed.
+    void recolor(const VertexTag* tags, size_t tagCount, const Coloring& coloring) {
+        if (tagCount < vertexCount)
+            return;
+        clearColors();
+        // the key of a vertex is its palette index, or HIDDEN_KEY for the hidden ones
+        const uint16_t HIDDEN_KEY = 256;
+        std::vector<uint16_t> keys(COMPACT_CHUNK);
+        int16_t entries[HIDDEN_KEY + 1];
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            ChunkColors chunk{};
+            size_t begin = i * COMPACT_CHUNK, count = std::min(COMPACT_CHUNK, vertexCount - begin);
+            const VertexTag* chunkTags = tags + begin;
+            for (size_t k = 0; k < count; ++k) {
+                keys[k] = chunkTags[k].heading == HIDDEN_HEADING ? HIDDEN_KEY : coloring.index(chunkTags[k]);
+            }
+
+            std::fill(entries, entries + HIDDEN_KEY + 1, -1);
+            chunk.paletteBegin = palette.size();
+            for (size_t k = 0; k < count; ++k) {
+                if (entries[keys[k]] >= 0)
+                    continue;
+                entries[keys[k]] = int16_t(palette.size() - chunk.paletteBegin);
+                palette.push_back(keys[k] == HIDDEN_KEY ? sf::Color::Transparent : coloring.paletteColor(uint8_t(keys[k])));
+            }
+            chunk.paletteSize = palette.size() - chunk.paletteBegin;
+
+            if (chunk.paletteSize > 256) {
+                // every index and a hidden vertex, only small figures in a gradient get there
+                chunk.colors = rawColors.size();
+                for (size_t k = 0; k < count; ++k) {
+                    rawColors.push_back(palette[chunk.paletteBegin + entries[keys[k]]]);
+                }
+                palette.resize(chunk.paletteBegin);
+                chunk.paletteSize = 0;
+                chunkColors.push_back(chunk);
+                continue;
+            }
+            chunk.colors = indices.size();
+            chunkColors.push_back(chunk);
+            // a uniform chunk needs no indices
+            if (chunk.paletteSize == 1)
+                continue;
+            for (size_t k = 0; k < count; ++k) {
+                indices.push_back(uint8_t(entries[keys[k]]));
+            }
+        }
+        shrink();
+    }
+
+    // Writes count draw-ready vertices from index begin on into out
+    void expand(size_t begin, size_t count, sf::Vertex* out) const {
+        size_t end = begin + count;
+        while (begin < end) {
+            const Chunk& chunk = chunks[begin / COMPACT_CHUNK];
+            const ChunkColors& colors = chunkColors[begin / COMPACT_CHUNK];
+            size_t offset = begin % COMPACT_CHUNK;
+            size_t n = std::min(COMPACT_CHUNK - offset, end - begin);
+            for (size_t i = 0; i < n; ++i) {
+                sf::Vertex& vertex = out[i];
+                size_t k = offset + i;
+                if (chunk.unit > 0) {
+                    vertex.position = sf::Vector2f(chunk.origin.x + fixedX[chunk.positions + k] * chunk.unit,
+                                                   chunk.origin.y + fixedY[chunk.positions + k] * chunk.unit);
+                } else {
+                    vertex.position = sf::Vector2f(floatX[chunk.positions + k], floatY[chunk.positions + k]);
+                }
+                if (colors.paletteSize == 1)
+                    vertex.color = palette[colors.paletteBegin];
+                else if (colors.paletteSize == 0)
+                    vertex.color = rawColors[colors.colors + k];
+                else
+                    vertex.color = palette[colors.paletteBegin + indices[colors.colors + k]];
+            }
+            out += n;
+            begin += n;
+        }
+    }
+
+    void clear() {
+        vertexCount = 0;
+        chunks.clear();
+        fixedX.clear();
+        fixedY.clear();
+        floatX.clear();
+        floatY.clear();
+        clearColors();
+        shrink();
+        batch.clear();
+        batch.shrink_to_fit();
+    }
+
+    void swap(CompactFigure& other) {
+        std::swap(type, other.type);
+        std::swap(vertexCount, other.vertexCount);
+        chunks.swap(other.chunks);
+        chunkColors.swap(other.chunkColors);
+        fixedX.swap(other.fixedX);
+        fixedY.swap(other.fixedY);
+        floatX.swap(other.floatX);
+        floatY.swap(other.floatY);
+        palette.swap(other.palette);
+        indices.swap(other.indices);
+        rawColors.swap(other.rawColors);
+    }
+
+    [[nodiscard]] sf::PrimitiveType getPrimitiveType() const { return type; }
+    [[nodiscard]] size_t getVertexCount() const { return vertexCount; }
+
+    // Bytes held for the geometry, the draw batch and mapped arrays excluded
+    [[nodiscard]] size_t getMemoryUsage() const {
+        return chunks.getHeldBytes() + chunkColors.getHeldBytes() + fixedX.getHeldBytes() + fixedY.getHeldBytes() +
+               floatX.getHeldBytes() + floatY.getHeldBytes() + palette.getHeldBytes() + indices.getHeldBytes() +
+               rawColors.getHeldBytes();
+    }
+
+    [[nodiscard]] CompactCounts getCounts() const {
+        return CompactCounts{chunks.size(), fixedX.size(), floatX.size(), palette.size(), indices.size(),
+                             rawColors.size()};
+    }
+
+    // Bytes write() writes for arrays of these counts
+    [[nodiscard]] static size_t getWrittenBytes(const CompactCounts& counts) {
+        return compactAligned(counts.chunks * sizeof(Chunk)) + compactAligned(counts.chunks * sizeof(ChunkColors)) +
+               2 * compactAligned(counts.fixed * sizeof(uint16_t)) + 2 * compactAligned(counts.floats * sizeof(float)) +
+               compactAligned(counts.palette * sizeof(sf::Color)) + compactAligned(counts.indices) +
+               compactAligned(counts.rawColors * sizeof(sf::Color));
+    }
+
+    // Passes the arrays to write(data, bytes) one after another, each padded to COMPACT_ALIGNMENT
+    template <typename Write>
+    void write(Write write) const {
+        const char padding[COMPACT_ALIGNMENT] = {};
+        auto writeArray = [&](const void* data, size_t bytes) {
+            write(data, bytes);
+            write(padding, compactAligned(bytes) - bytes);
+        };
+        writeArray(chunks.data(), chunks.size() * sizeof(Chunk));
+        writeArray(chunkColors.data(), chunkColors.size() * sizeof(ChunkColors));
+        writeArray(fixedX.data(), fixedX.size() * sizeof(uint16_t));
+        writeArray(fixedY.data(), fixedY.size() * sizeof(uint16_t));
+        writeArray(floatX.data(), floatX.size() * sizeof(float));
+        writeArray(floatY.data(), floatY.size() * sizeof(float));
+        writeArray(palette.data(), palette.size() * sizeof(sf::Color));
+        writeArray(indices.data(), indices.size());
+        writeArray(rawColors.data(), rawColors.size() * sizeof(sf::Color));
+    }
+
+    // Reads the arrays write() wrote in place at data, which mapping keeps alive. Without
+    // withColors the figure is left to be colored by recolor(). False, with the figure left
+    // empty, when the arrays don't make a figure of _vertexCount vertices.
+    bool map(sf::PrimitiveType _type, size_t _vertexCount, const CompactCounts& counts, const char* data,
+             bool withColors, const std::shared_ptr<const void>& mapping) {
+        clear();
+        auto mapArray = [&](auto& array, size_t count) {
+            typedef typename std::remove_reference<decltype(array[0])>::type Element;
+            array.map(reinterpret_cast<const Element*>(data), count, mapping);
+            data += compactAligned(count * sizeof(Element));
+        };
+        mapArray(chunks, counts.chunks);
+        mapArray(chunkColors, counts.chunks);
+        mapArray(fixedX, counts.fixed);
+        mapArray(fixedY, counts.fixed);
+        mapArray(floatX, counts.floats);
+        mapArray(floatY, counts.floats);
+        mapArray(palette, counts.palette);
+        mapArray(indices, counts.indices);
+        mapArray(rawColors, counts.rawColors);
+        type = _type;
+        vertexCount = _vertexCount;
+
+        bool isValid = counts.chunks == (vertexCount + COMPACT_CHUNK - 1) / COMPACT_CHUNK and
+                       counts.fixed + counts.floats == vertexCount;
+        for (size_t i = 0; i < chunks.size() and isValid; ++i) {
+            size_t count = std::min(COMPACT_CHUNK, vertexCount - i * COMPACT_CHUNK);
+            const Chunk& chunk = chunks[i];
+            const ChunkColors& colors = chunkColors[i];
+            isValid = chunk.positions + count <= (chunk.unit > 0 ? counts.fixed : counts.floats);
+            if (!withColors)
+                continue;
+            if (colors.paletteSize == 0)
+                isValid = isValid and colors.colors + count <= counts.rawColors;
+            else
+                isValid = isValid and colors.paletteBegin + colors.paletteSize <= counts.palette and
+                          (colors.paletteSize == 1 or colors.colors + count <= counts.indices);
+        }
+        if (!isValid) {
+            clear();
+            return false;
+        }
+        if (!withColors)
+            clearColors();
+        return true;
+    }
+};
+
+#endif //SPBU_SEMESTER1_FRACTALS_COMPACT_H
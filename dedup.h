@@ -0,0 +1,142 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_DEDUP_H
+#define SPBU_SEMESTER1_FRACTALS_DEDUP_H
+
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include "settings.h"
+#include "parallel.h"
+#include "coloring.h"
+#include "raster.h"
+
+// Segment ends closer than this, in world units, are taken for the same point
+const double DEDUP_QUANTUM = 1.0 / 64;
+
+// A segment by its quantized ends, the smaller end first, so both directions give the same key
+struct SegmentKey {
+    int64_t x0, y0, x1, y1;
+
+    bool operator==(const SegmentKey& other) const {
+        return x0 == other.x0 and y0 == other.y0 and x1 == other.x1 and y1 == other.y1;
+    }
+};
+
+inline SegmentKey segmentKey(const sf::Vertex& a, const sf::Vertex& b) {
+    SegmentKey key{std::llround(a.position.x / DEDUP_QUANTUM), std::llround(a.position.y / DEDUP_QUANTUM),
+                   std::llround(b.position.x / DEDUP_QUANTUM), std::llround(b.position.y / DEDUP_QUANTUM)};
+    if (key.x1 < key.x0 or (key.x1 == key.x0 and key.y1 < key.y0)) {
+        std::swap(key.x0, key.x1);
+        std::swap(key.y0, key.y1);
+    }
+    return key;
+}
+
+inline uint64_t segmentHash(const SegmentKey& key) {
+    uint64_t h = uint64_t(key.x0) * 0x9E3779B97F4A7C15ULL;
+    h ^= uint64_t(key.y0) * 0xC2B2AE3D27D4EB4FULL;
+    h = (h ^ (h >> 31)) * 0x165667B19E3779F9ULL;
+    h ^= uint64_t(key.x1) * 0x9E3779B97F4A7C15ULL;
+    h ^= uint64_t(key.y1) * 0xC2B2AE3D27D4EB4FULL;
+    return h ^ (h >> 29);
+}
+
+// Removes the segments a line strip draws more than once (with the same ends, in either
+// direction) and returns how many were removed. Every drawn segment is hashed into an open
+// addressing table filled by all workers at once; a slot holds the first segment with its
+// key, so the one kept doesn't depend on the order the workers get there. The strip is then
+// rebuilt from the kept segments, with a jump between hidden vertices where it has a gap.
+// Overlaps of segments with different ends, such as a merged run over a part of it, stay.
+inline size_t removeDuplicateSegments(sf::VertexArray& figure, std::vector<VertexTag>* tags = nullptr) {
+    size_t vertexCount = figure.getVertexCount();
+    if (vertexCount < 3)
+        return 0;
+    size_t capacity = 1;
+    while (capacity < 2 * vertexCount) {
+        capacity <<= 1;
+    }
+    // segments are named by their end vertex, so 0 marks an empty slot
+    std::vector<std::atomic<size_t>> table(capacity);
+    int parts = partsNumber(vertexCount, MIN_PARALLEL_CHUNK);
+
+    runParallel(parts, [&](int part) {
+        for (size_t i = std::max<size_t>(1, vertexCount * part / parts); i < vertexCount * (part + 1) / parts; ++i) {
+            if (!isDrawn(figure[i - 1], figure[i]))
+                continue;
+            SegmentKey key = segmentKey(figure[i - 1], figure[i]);
+            for (size_t slot = segmentHash(key) & (capacity - 1);; slot = (slot + 1) & (capacity - 1)) {
+                size_t first = table[slot].load();
+                if (first == 0 and table[slot].compare_exchange_strong(first, i))
+                    break;
+                // first now holds the segment in the slot
+                if (segmentKey(figure[first - 1], figure[first]) == key) {
+                    while (i < first and !table[slot].compare_exchange_weak(first, i)) {
+                    }
+                    break;
+                }
+            }
+        }
+    });
+
+    std::vector<uint8_t> isKept(vertexCount, 0);
+    std::vector<size_t> drawn(parts, 0), kept(parts, 0);
+    runParallel(parts, [&](int part) {
+        for (size_t i = std::max<size_t>(1, vertexCount * part / parts); i < vertexCount * (part + 1) / parts; ++i) {
+            if (!isDrawn(figure[i - 1], figure[i]))
+                continue;
+            ++drawn[part];
+            SegmentKey key = segmentKey(figure[i - 1], figure[i]);
+            size_t slot = segmentHash(key) & (capacity - 1);
+            while (!(segmentKey(figure[table[slot] - 1], figure[table[slot]]) == key)) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            isKept[i] = table[slot] == i;
+            kept[part] += isKept[i];
+        }
+    });
+    size_t removed = 0;
+    for (int part = 0; part < parts; ++part) {
+        removed += drawn[part] - kept[part];
+    }
+    if (removed == 0)
+        return 0;
+
+    std::vector<sf::Vertex> vertices;
+    std::vector<VertexTag> vertexTags;
+    auto add = [&](size_t i, bool isVisible) {
+        vertices.push_back(figure[i]);
+        if (!isVisible)
+            vertices.back().color = sf::Color::Transparent;
+        if (tags != nullptr) {
+            vertexTags.push_back((*tags)[i]);
+            if (!isVisible)
+                vertexTags.back().heading = HIDDEN_HEADING;
+        }
+    };
+    // the original index of the last vertex added
+    size_t last = 0;
+    for (size_t i = 1; i < vertexCount; ++i) {
+        if (!isKept[i])
+            continue;
+        if (vertices.empty() or last != i - 1) {
+            if (!vertices.empty()) {
+                add(last, false);
+                add(i - 1, false);
+            }
+            add(i - 1, true);
+        }
+        add(i, true);
+        last = i;
+    }
+
+    figure.resize(vertices.size());
+    std::copy(vertices.begin(), vertices.end(), &figure[0]);
+    if (tags != nullptr)
+        tags->swap(vertexTags);
+    return removed;
+}
+
+#endif //SPBU_SEMESTER1_FRACTALS_DEDUP_H
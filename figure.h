@@ -0,0 +1,838 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_FIGURE_H
+#define SPBU_SEMESTER1_FRACTALS_FIGURE_H
+
+#include <SFML/Graphics.hpp>
+#include <string>
+#include <vector>
+#include <array>
+#include <stack>
+#include <atomic>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include <chrono>
+#include <memory>
+
+#include "settings.h"
+#include "parallel.h"
+#include "lsystem.h"
+#include "stochastic.h"
+#include "robot.h"
+#include "coloring.h"
+#include "dedup.h"
+
+// Feeds the symbols of the stream to the robot, emitting the vertices of its line strip through
+// onVertex(x, y, isVisible). useMemory enables '[' and ']' (only the Plant saves and restores
+// its position). The strip starts in state strip and the state it ends in is returned.
+// With control set the progress is reported and the walk stops once it is cancelled.
+template <typename OnVertex>
+uint8_t interpretSymbols(LSystemStream& symbols, const LSystem* lSystem, Robot* robot, bool useMemory,
+                         OnVertex onVertex, BuildControl* control = nullptr, uint8_t strip = 0) {
+    char c;
+    uint64_t count = 0;
+    while (symbols.next(c)) {
+        if (control != nullptr and ++count == BUILD_CHECK_INTERVAL) {
+            control->done += count;
+            count = 0;
+            if (control->isCancelled)
+                return strip;
+        }
+
+        if (lSystem->isDrawing(c)) {
+            addVertex(robot, strip, onVertex);
+            robot->move();
+        } else if (c == '-') {
+            robot->rotate(+lSystem->getAngle());
+            strip |= STRIP_TURNED;
+        } else if (c == '+') {
+            robot->rotate(-lSystem->getAngle());
+            strip |= STRIP_TURNED;
+        } else if (c == '[') {
+            if (useMemory) {
+                robot->getMemory()->push(robot->getData());
+            }
+        } else if (c == ']') {
+            if (useMemory) {
+                closeBranch(robot, strip, onVertex);
+            }
+        }
+    }
+    if (control != nullptr)
+        control->done += count;
+    return strip;
+}
+
+// Net effect of a subtree on a robot starting at (0, 0) with angle 0
+struct MacroStep {
+    double dx, dy, dAngle;
+    // every position the robot visits inside the subtree lies in this box
+    double minX, minY, maxX, maxY;
+    // steps the robot makes in the subtree
+    uint64_t moves;
+    // vertices the subtree emits and the strip state it leaves, by the strip state it starts in
+    std::array<uint64_t, STRIP_STATES> vertexCount;
+    std::array<uint8_t, STRIP_STATES> stripAfter;
+};
+
+// Memoized macro-steps for every (symbol, remaining generations) pair. A whole
+// subtree can be skipped in O(1), so final positions, bounds and vertex counts of
+// a figure cost O(gens * rule length) instead of O(output length).
+class MacroSteps {
+private:
+    const LSystem* lSystem;
+    bool useMemory;
+    // steps[depth][c]
+    std::vector<std::array<MacroStep, 256>> steps;
+
+    MacroStep leaf(char c, bool isInverse) const {
+        MacroStep res = still();
+        if (lSystem->isDrawing(c)) {
+            res.dx = step;
+            res.maxX = step;
+            res.moves = 1;
+            for (int strip = 0; strip < STRIP_STATES; ++strip) {
+                res.vertexCount[strip] = stepVertices(uint8_t(strip));
+                res.stripAfter[strip] = STRIP_MOVED;
+            }
+        } else if (c == '-' or c == '+') {
+            res.dAngle = (c == '-') != isInverse ? +lSystem->getAngle() : -lSystem->getAngle();
+            for (int strip = 0; strip < STRIP_STATES; ++strip) {
+                res.stripAfter[strip] = uint8_t(strip | STRIP_TURNED);
+            }
+        }
+        return res;
+    }
+
+    // A subtree that does nothing
+    static MacroStep still() {
+        MacroStep res{0, 0, 0, 0, 0, 0, 0, 0, {}, {}};
+        for (int strip = 0; strip < STRIP_STATES; ++strip) {
+            res.stripAfter[strip] = uint8_t(strip);
+        }
+        return res;
+    }
+public:
+    MacroSteps(const LSystem* _lSystem, bool _useMemory) {
+        lSystem = _lSystem;
+        useMemory = _useMemory;
+
+        bool isInverse = lSystem->getGens() % 2 == 0;
+        steps.resize(lSystem->getGens() + 1);
+        for (int c = 0; c < 256; ++c) {
+            steps[0][c] = leaf(char(c), isInverse);
+        }
+        for (int depth = 1; depth <= lSystem->getGens(); ++depth) {
+            for (int c = 0; c < 256; ++c) {
+                const std::string* rule = lSystem->getRule(char(c));
+                steps[depth][c] = rule == nullptr ? steps[0][c] : compose(*rule, depth - 1);
+            }
+        }
+    }
+
+    [[nodiscard]] const MacroStep& get(char c, int depth) const { return steps[depth][(unsigned char)c]; }
+
+    // Macro-step of a whole word after depth more rewrites
+    [[nodiscard]] MacroStep compose(const std::string& word, int depth) const {
+        MacroStep res = still();
+        RobotData state{0, 0, 0};
+        std::vector<RobotData> memory;
+        for (char c : word) {
+            if (useMemory and c == '[') {
+                memory.push_back(state);
+                continue;
+            }
+            if (useMemory and c == ']') {
+                // the vertices of the break lie on positions already visited, the bounds stay
+                state = memory.back();
+                memory.pop_back();
+                for (int strip = 0; strip < STRIP_STATES; ++strip) {
+                    // the end of the branch and the start of the jump back, see closeBranch()
+                    if (res.stripAfter[strip] & STRIP_MOVED)
+                        res.vertexCount[strip] += 2;
+                    res.stripAfter[strip] = STRIP_JUMPING;
+                }
+                continue;
+            }
+
+            const MacroStep& m = get(c, depth);
+            sf::FloatRect box = bounds(m, state);
+            res.minX = std::min(res.minX, double(box.left));
+            res.minY = std::min(res.minY, double(box.top));
+            res.maxX = std::max(res.maxX, double(box.left + box.width));
+            res.maxY = std::max(res.maxY, double(box.top + box.height));
+            res.moves += m.moves;
+            for (int strip = 0; strip < STRIP_STATES; ++strip) {
+                res.vertexCount[strip] += m.vertexCount[res.stripAfter[strip]];
+                res.stripAfter[strip] = m.stripAfter[res.stripAfter[strip]];
+            }
+            state = apply(m, state);
+        }
+        res.dx = state.x;
+        res.dy = state.y;
+        res.dAngle = state.angle;
+        return res;
+    }
+
+    // Vertices of the whole figure, the last one included
+    [[nodiscard]] static uint64_t countVertices(const MacroStep& figure) {
+        return figure.vertexCount[0] + lastVertices(figure.stripAfter[0]);
+    }
+
+    // State of a robot after walking the subtree from `from`
+    static RobotData apply(const MacroStep& m, const RobotData& from) {
+        double angle_rad = from.angle * 2 * PI / 360;
+        double cosA = cos(angle_rad), sinA = sin(angle_rad);
+        return {from.x + cosA * m.dx + sinA * m.dy,
+                from.y - sinA * m.dx + cosA * m.dy,
+                from.angle + m.dAngle};
+    }
+
+    // Conservative bounds of the subtree walked from `from`
+    static sf::FloatRect bounds(const MacroStep& m, const RobotData& from) {
+        double angle_rad = from.angle * 2 * PI / 360;
+        double cosA = cos(angle_rad), sinA = sin(angle_rad);
+        double minX = from.x, minY = from.y, maxX = from.x, maxY = from.y;
+        bool first = true;
+        for (double x : {m.minX, m.maxX}) {
+            for (double y : {m.minY, m.maxY}) {
+                double px = from.x + cosA * x + sinA * y;
+                double py = from.y - sinA * x + cosA * y;
+                if (first) {
+                    minX = maxX = px;
+                    minY = maxY = py;
+                    first = false;
+                }
+                minX = std::min(minX, px);
+                minY = std::min(minY, py);
+                maxX = std::max(maxX, px);
+                maxY = std::max(maxY, py);
+            }
+        }
+        return {float(minX), float(minY), float(maxX - minX), float(maxY - minY)};
+    }
+};
+
+// Sets the vertex at the robot's position, colored and tagged when asked to. Hidden
+// vertices, the ends of the jumps between branches, are transparent whatever the coloring.
+inline void writeVertex(sf::Vertex& vertex, VertexTag* tag, const Robot* robot, bool isVisible,
+                        const Coloring* coloring, uint16_t outerDepth = 0, uint32_t outerBranch = 0) {
+    vertex.position = sf::Vector2f(robot->getBeginX(), robot->getBeginY());
+    if (coloring != nullptr or tag != nullptr) {
+        VertexTag vertexTag = tagOf(robot, outerDepth, outerBranch);
+        if (!isVisible)
+            vertexTag.heading = HIDDEN_HEADING;
+        if (coloring != nullptr)
+            vertex.color = coloring->color(vertexTag);
+        if (tag != nullptr)
+            *tag = vertexTag;
+    }
+    if (!isVisible)
+        vertex.color = sf::Color::Transparent;
+}
+
+// A contiguous piece of the word at the split generation. Brackets are pieces of
+// their own; every other piece is a rigid motion of the robot once expanded.
+struct FigurePiece {
+    std::string word;
+    char bracket;
+    MacroStep motion;
+    // filled by the scan
+    RobotData begin;
+    uint8_t strip;
+    size_t vertexOffset;
+    uint64_t stepOffset;
+    // branches the piece is nested in, for the coloring
+    uint16_t depth;
+    uint32_t branch;
+};
+
+// Interprets the symbols in parallel: the net motion of every piece comes from the
+// macro-steps, the motions are scanned in order to get the state each piece
+// starts from, and then every piece writes its vertices into the presized figure.
+inline void makeFigureParallel(sf::VertexArray& figure, LSystem* lSystem, Robot* robot, const std::string& robotName,
+                               bool useMemory, int parts, BuildControl* control = nullptr,
+                               const Coloring* coloring = nullptr, std::vector<VertexTag>* tags = nullptr) {
+    // Split at the first generation that has enough symbols to balance the work
+    const std::string& initAxiom = lSystem->getInitAxiom();
+    const size_t wantedPieces = size_t(parts) * 16;
+    int splitGens = 0;
+    while (splitGens < lSystem->getGens() and lSystem->getExpandedLength(initAxiom, splitGens) < wantedPieces) {
+        ++splitGens;
+    }
+    int restGens = lSystem->getGens() - splitGens;
+    bool isInverse = lSystem->getGens() % 2 == 0;
+
+    std::string splitWord;
+    splitWord.reserve(lSystem->getExpandedLength(initAxiom, splitGens));
+    LSystemStream splitSymbols(lSystem, &initAxiom, splitGens, false);
+    char c;
+    while (splitSymbols.next(c)) {
+        splitWord += c;
+    }
+
+    uint64_t pieceLength = std::max<uint64_t>(1, lSystem->getExpandedLength(splitWord, restGens) / wantedPieces);
+    std::vector<FigurePiece> pieces;
+    FigurePiece run{};
+    uint64_t runLength = 0;
+    for (char s : splitWord) {
+        if (useMemory and (s == '[' or s == ']')) {
+            if (!run.word.empty())
+                pieces.push_back(run);
+            run = FigurePiece{};
+            runLength = 0;
+
+            FigurePiece bracket{};
+            bracket.bracket = s;
+            pieces.push_back(bracket);
+            continue;
+        }
+
+        run.word += s;
+        runLength += lSystem->getExpandedLength(s, restGens);
+        if (runLength >= pieceLength) {
+            pieces.push_back(run);
+            run = FigurePiece{};
+            runLength = 0;
+        }
+    }
+    if (!run.word.empty())
+        pieces.push_back(run);
+
+    MacroSteps macroSteps(lSystem, useMemory);
+    for (FigurePiece& piece : pieces) {
+        if (piece.bracket == 0)
+            piece.motion = macroSteps.compose(piece.word, restGens);
+    }
+
+    // The scan itself is cheap: one step per piece. The breaks of branches closed at the
+    // split level are written here, they are set aside until the figure is sized.
+    Robot scanner(robotName, 0, 0);
+    scanner.useLattice(*robot);
+    scanner.setData(robot->getData());
+    struct Break {
+        size_t index;
+        sf::Vertex vertex;
+        VertexTag tag;
+    };
+    std::vector<Break> breaks;
+    uint8_t strip = 0;
+    size_t vertexOffset = 0;
+    for (FigurePiece& piece : pieces) {
+        if (piece.bracket == '[') {
+            scanner.getMemory()->push(scanner.getData());
+            continue;
+        }
+        if (piece.bracket == ']') {
+            closeBranch(&scanner, strip, [&](double, double, bool isVisible) {
+                breaks.push_back(Break{vertexOffset++, {}, {}});
+                writeVertex(breaks.back().vertex, &breaks.back().tag, &scanner, isVisible, coloring);
+            });
+            continue;
+        }
+
+        std::stack<RobotData>* memory = scanner.getMemory();
+        piece.begin = scanner.getData();
+        piece.strip = strip;
+        piece.vertexOffset = vertexOffset;
+        piece.stepOffset = scanner.getSteps();
+        piece.depth = uint16_t(memory->size());
+        piece.branch = memory->empty() ? 0 : branchId(memory->top());
+        vertexOffset += piece.motion.vertexCount[strip];
+        strip = piece.motion.stripAfter[strip];
+        scanner.setData(MacroSteps::apply(piece.motion, scanner.getData()));
+        scanner.setSteps(scanner.getSteps() + piece.motion.moves);
+    }
+
+    size_t vertexCount = vertexOffset + lastVertices(strip);
+    figure.resize(vertexCount);
+    if (tags != nullptr)
+        tags->resize(vertexCount);
+    for (const Break& vertex : breaks) {
+        figure[vertex.index] = vertex.vertex;
+        if (tags != nullptr)
+            (*tags)[vertex.index] = vertex.tag;
+    }
+    // Pieces have different lengths, so workers take them one by one
+    std::atomic<size_t> nextPiece(0);
+    runParallel(parts, [&](int) {
+        for (size_t i = nextPiece++; i < pieces.size(); i = nextPiece++) {
+            FigurePiece& piece = pieces[i];
+            if (piece.bracket != 0 or (control != nullptr and control->isCancelled))
+                continue;
+
+            Robot local(robotName, 0, 0);
+            local.useLattice(*robot);
+            local.setData(piece.begin);
+            local.setSteps(piece.stepOffset);
+            LSystemStream symbols(lSystem, &piece.word, restGens, isInverse);
+            size_t vertex = piece.vertexOffset;
+            interpretSymbols(symbols, lSystem, &local, useMemory, [&](double, double, bool isVisible) {
+                writeVertex(figure[vertex], tags != nullptr ? &(*tags)[vertex] : nullptr, &local, isVisible,
+                            coloring, piece.depth, piece.branch);
+                ++vertex;
+            }, control, piece.strip);
+        }
+    });
+
+    // Add last vertex
+    robot->setData(scanner.getData());
+    robot->setSteps(scanner.getSteps());
+    endStrip(robot, strip, [&](double, double, bool isVisible) {
+        writeVertex(figure[vertexOffset], tags != nullptr ? &(*tags)[vertexOffset] : nullptr, robot, isVisible,
+                    coloring);
+        ++vertexOffset;
+    });
+}
+
+// Appends a vertex at the robot's position, colored and tagged when asked to
+inline void appendVertex(sf::VertexArray& figure, const Robot* robot, const Coloring* coloring,
+                         std::vector<VertexTag>* tags, bool isVisible = true) {
+    sf::Vertex vertex;
+    VertexTag tag{};
+    writeVertex(vertex, tags != nullptr ? &tag : nullptr, robot, isVisible, coloring);
+    figure.append(vertex);
+    if (tags != nullptr)
+        tags->push_back(tag);
+}
+
+// Interprets the whole word on the calling thread
+inline void makeFigureSerial(sf::VertexArray& figure, LSystem* lSystem, Robot* robot, bool useMemory,
+                             BuildControl* control = nullptr, const Coloring* coloring = nullptr,
+                             std::vector<VertexTag>* tags = nullptr) {
+    LSystemStream symbols(lSystem);
+    auto onVertex = [&](double, double, bool isVisible) {
+        appendVertex(figure, robot, coloring, tags, isVisible);
+    };
+    uint8_t strip = interpretSymbols(symbols, lSystem, robot, useMemory, onVertex, control);
+
+    // Add last vertex
+    endStrip(robot, strip, onVertex);
+}
+
+// Like sf::FloatRect::intersects, but also true for boxes of zero width or height
+inline bool touches(const sf::FloatRect& a, const sf::FloatRect& b) {
+    return a.left <= b.left + b.width and b.left <= a.left + a.width and
+           a.top <= b.top + b.height and b.top <= a.top + a.height;
+}
+
+// Expands only what is visible: a subtree whose bounds miss visibleArea, or that is
+// smaller than pixelSize, is walked over in one jump and drawn as a single segment
+// from its start to its end. That segment stays inside the subtree bounds, so it
+// is either off-screen or under a pixel.
+inline void makeFigureInView(sf::VertexArray& figure, LSystem* lSystem, Robot* robot, bool useMemory,
+                             const sf::FloatRect& visibleArea, float pixelSize, BuildControl* control = nullptr,
+                             const Coloring* coloring = nullptr, std::vector<VertexTag>* tags = nullptr) {
+    struct Frame {
+        const std::string* word;
+        size_t pos;
+        int depth;
+    };
+
+    MacroSteps macroSteps(lSystem, useMemory);
+    std::vector<Frame> frames;
+    frames.reserve(lSystem->getGens() + 1);
+    frames.push_back({&lSystem->getInitAxiom(), 0, lSystem->getGens()});
+
+    uint64_t count = 0;
+    uint8_t strip = 0;
+    auto onVertex = [&](double, double, bool isVisible) {
+        appendVertex(figure, robot, coloring, tags, isVisible);
+    };
+    while (!frames.empty()) {
+        if (control != nullptr and ++count == BUILD_CHECK_INTERVAL) {
+            control->done += count;
+            count = 0;
+            if (control->isCancelled)
+                return;
+        }
+
+        Frame& top = frames.back();
+        if (top.pos == top.word->size()) {
+            frames.pop_back();
+            continue;
+        }
+
+        char c = (*top.word)[top.pos++];
+        int depth = top.depth;
+        if (useMemory and c == '[') {
+            robot->getMemory()->push(robot->getData());
+            continue;
+        }
+        if (useMemory and c == ']') {
+            closeBranch(robot, strip, onVertex);
+            continue;
+        }
+
+        const MacroStep& m = macroSteps.get(c, depth);
+        const std::string* rule = lSystem->getRule(c);
+        if (rule != nullptr and depth > 0) {
+            sf::FloatRect box = MacroSteps::bounds(m, robot->getData());
+            if (touches(box, visibleArea) and std::max(box.width, box.height) >= pixelSize) {
+                frames.push_back({rule, 0, depth - 1});
+                continue;
+            }
+        }
+
+        // A leaf symbol or a pruned subtree
+        bool isPruned = rule != nullptr and depth > 0;
+        uint8_t stripAfter = m.stripAfter[strip];
+        // the jump over a pruned subtree is not a step in the heading of the last one,
+        // a straight run can neither go on into it nor out of it without a vertex
+        if (isPruned)
+            strip |= STRIP_TURNED;
+        if (m.moves > 0)
+            addVertex(robot, strip, onVertex);
+        strip = stripAfter;
+        if (!isPruned) {
+            if (m.moves > 0)
+                robot->move();
+            else if (m.dAngle != 0)
+                robot->rotate(int(m.dAngle));
+        } else {
+            robot->setData(MacroSteps::apply(m, robot->getData()));
+            // the steps of the subtree still count towards the arc of what follows
+            robot->setSteps(robot->getSteps() + m.moves);
+            strip |= STRIP_TURNED;
+        }
+    }
+
+    // Add last vertex
+    endStrip(robot, strip, onVertex);
+}
+
+// Index in the expanded word of the symbol that makes step `wanted` of the whole figure, counted
+// from 0 like the arc of a tag. Subtrees are skipped by their macro-steps as in makeFigureInView(),
+// so it takes O(gens * rule length) once macroSteps are built; a step past the last gives the word length.
+inline uint64_t symbolOfStep(const LSystem* lSystem, const MacroSteps& macroSteps, uint64_t wanted) {
+    const std::string* word = &lSystem->getInitAxiom();
+    size_t pos = 0;
+    int depth = lSystem->getGens();
+    // index of the next symbol and of the next step
+    uint64_t symbol = 0, first = 0;
+    while (pos < word->size()) {
+        char c = (*word)[pos++];
+        const MacroStep& m = macroSteps.get(c, depth);
+        if (wanted < first + m.moves) {
+            const std::string* rule = lSystem->getRule(c);
+            if (rule == nullptr or depth == 0)
+                return symbol;
+            word = rule;
+            pos = 0;
+            --depth;
+            continue;
+        }
+        first += m.moves;
+        symbol += lSystem->getExpandedLength(c, depth);
+    }
+    return symbol;
+}
+
+inline LSystem* createLSystem(const std::string& robotName, int gensNumber) {
+    if (robotName == "Plant") {
+        return new LSystem("X", 'X', 'F', "F-[[X]+X]+F[+FX]-X", "FF", 25, gensNumber);
+    } else if (robotName == "Sierpinski triangle") {
+        return new LSystem("A", 'A', 'B', "B-A-B", "A+B+A", 60, gensNumber);
+    } else if (robotName == "Dragon curve") {
+        return new LSystem("FX", 'X', 'Y', "X+YF+", "-FX-Y", 90, gensNumber);
+    } else if (robotName == "Koch's snowflake") {
+        return new LSystem("F++F++F", 'F', "F-F++F-F", 60, gensNumber);
+    }
+    return nullptr;
+}
+
+// Figures built by StochasticLSystem: their rules pick between weighted alternatives or
+// look at the neighbours of the rewritten symbol
+inline bool isStochastic(const std::string& robotName) {
+    return robotName == "Forest" or robotName == "Hogeweg plant";
+}
+
+// Seed of the stochastic figures, the same seed always gives the same figure
+const uint64_t FOREST_SEED = 2021;
+// Trees in the Forest and steps between neighbouring trees
+const int FOREST_TREES = 60, FOREST_SPACING = 24;
+
+inline StochasticLSystem* createStochasticLSystem(const std::string& robotName, int gensNumber, uint64_t seed) {
+    if (robotName == "Forest") {
+        // every tree turns up from the ground line, grows and comes back
+        std::string axiom;
+        for (int tree = 0; tree < FOREST_TREES; ++tree) {
+            axiom += "[-----X(6)]G(" + std::to_string(FOREST_SPACING) + ")";
+        }
+        return new StochasticLSystem(axiom, {
+                {'X', {0.4, parseModules("F(1)[+X(0.8)][-X(0.8)]F(1)X(0.9)")}},
+                {'X', {0.3, parseModules("F(1)[+X(0.7)]F(1.2)X(0.9)")}},
+                {'X', {0.3, parseModules("F(1)[-X(0.7)]F(1.2)X(0.9)")}},
+        }, "FG", 18, gensNumber, seed);
+    } else if (robotName == "Hogeweg plant") {
+        // Hogeweg and Hesper's plant: signals 0 and 1 travel along the stem and into the
+        // branches by the left and right neighbours of a symbol, looking through turns and
+        // segments, and branches grow where they meet
+        auto rule = [](char left, const char* successor, char right) {
+            return Production{1, parseModules(successor), left, right};
+        };
+        StochasticLSystem* lSystem = new StochasticLSystem("F1F1F1", {
+                {'0', rule('0', "0", '0')}, {'0', rule('0', "1[+F1F1]", '1')},
+                {'1', rule('0', "1", '0')}, {'1', rule('0', "1", '1')},
+                {'0', rule('1', "0", '0')}, {'0', rule('1', "1F1", '1')},
+                {'1', rule('1', "0", '0')}, {'1', rule('1', "0", '1')},
+                {'+', {1, parseModules("-")}}, {'-', {1, parseModules("+")}},
+        }, "F", 22, gensNumber, seed);
+        lSystem->setIgnored("+-F");
+        return lSystem;
+    }
+    return nullptr;
+}
+
+// Angle the robot of the figure starts with
+inline int startAngle(const std::string& robotName) {
+    if (robotName == "Hogeweg plant")
+        return 90;
+    return robotName == "Plant" ? 45 : 0;
+}
+
+// Only the Plant saves and restores its position with '[' and ']'
+inline bool usesMemory(const std::string& robotName) {
+    return robotName == "Plant";
+}
+
+// Turns a robot standing at the start of the figure to its start angle. Its steps are then
+// counted on the lattice of the system, so long walks don't drift.
+inline void placeRobot(Robot* robot, const std::string& robotName, const LSystem* lSystem) {
+    robot->rotate(startAngle(robotName));
+    robot->useLattice(latticeAngle(lSystem->getAngle()), robot->getBeginX(), robot->getBeginY());
+}
+
+inline sf::Color figureColor(const std::string& robotName) {
+    if (robotName == "Dragon curve") {
+        return sf::Color::Red;
+    } else if (robotName == "Koch's snowflake"){
+        return sf::Color::Blue;
+    } else if (robotName == "Plant") {
+        return sf::Color::Green;
+    } else if (robotName == "Sierpinski triangle") {
+        return sf::Color::Green;
+    } else if (robotName == "Forest") {
+        return sf::Color(34, 139, 34);
+    } else if (robotName == "Hogeweg plant") {
+        return sf::Color(154, 205, 50);
+    }
+    return sf::Color::White;
+}
+
+// A line strip pays two hidden vertices for every jump between branches, sf::Lines a second
+// vertex for every segment. Turns a finished strip, with its tags, into sf::Lines when that
+// takes fewer vertices, and returns the number of drawn segments. The segments are counted
+// and then copied by all workers at once, each into its own run of the new figure.
+inline uint64_t choosePrimitive(sf::VertexArray& figure, std::vector<VertexTag>* tags = nullptr) {
+    size_t vertexCount = figure.getVertexCount();
+    if (vertexCount < 2)
+        return 0;
+    int parts = partsNumber(vertexCount, MIN_PARALLEL_CHUNK);
+    std::vector<size_t> drawn(parts + 1, 0);
+    auto partBegin = [&](int part) { return std::max<size_t>(1, vertexCount * part / parts); };
+    runParallel(parts, [&](int part) {
+        for (size_t i = partBegin(part); i < vertexCount * (part + 1) / parts; ++i) {
+            drawn[part + 1] += isDrawn(figure[i - 1], figure[i]);
+        }
+    });
+    for (int part = 0; part < parts; ++part) {
+        drawn[part + 1] += drawn[part];
+    }
+    uint64_t segments = drawn[parts];
+    if (vertexCount <= 2 * segments)
+        return segments;
+
+    sf::VertexArray lines(sf::Lines, 2 * segments);
+    std::vector<VertexTag> lineTags(tags != nullptr ? 2 * segments : 0);
+    runParallel(parts, [&](int part) {
+        size_t next = 2 * drawn[part];
+        for (size_t i = partBegin(part); i < vertexCount * (part + 1) / parts; ++i) {
+            if (!isDrawn(figure[i - 1], figure[i]))
+                continue;
+            lines[next] = figure[i - 1];
+            lines[next + 1] = figure[i];
+            if (tags != nullptr) {
+                lineTags[next] = (*tags)[i - 1];
+                lineTags[next + 1] = (*tags)[i];
+            }
+            next += 2;
+        }
+    });
+    figure = std::move(lines);
+    if (tags != nullptr)
+        tags->swap(lineTags);
+    return segments;
+}
+
+// Timings and sizes of one makeFigure() call
+struct FigureStats {
+    double setupMs, interpretMs;
+    // steps is what the arc-length gradient spans
+    uint64_t symbols, vertices, steps;
+    // drawn segments and what they are drawn as, see choosePrimitive()
+    uint64_t segments;
+    sf::PrimitiveType primitive;
+    // steps the robot makes, straight runs of them share a segment; 0 for culled builds
+    uint64_t moves;
+    // spent on and segments removed by removeDuplicates, 0 without it
+    double dedupMs;
+    uint64_t duplicates;
+    // loaded from the geometry cache rather than built
+    bool isCached;
+    // what the vertices are colored by
+    ColorMode colorMode;
+    size_t symbolBytes, vertexBytes;
+};
+
+inline double millisecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Word of a stochastic figure after gensNumber rewrites, kept in generationCache() between builds
+inline std::shared_ptr<const std::vector<Module>> stochasticWord(const std::string& robotName,
+                                                                 const StochasticLSystem* lSystem, int gensNumber,
+                                                                 BuildControl* control = nullptr) {
+    return generationCache().get(robotName + "#" + std::to_string(FOREST_SEED), lSystem, gensNumber, control);
+}
+
+// Builds a stochastic figure; it is expanded in full, whatever part of it is visible
+inline void makeStochasticFigure(sf::VertexArray& figure, const std::string& robotName, int gensNumber,
+                                 FigureStats* stats = nullptr, BuildControl* control = nullptr,
+                                 ColorMode colorMode = ColorMode::Flat, std::vector<VertexTag>* tags = nullptr,
+                                 bool removeDuplicates = false) {
+    auto phaseStart = std::chrono::steady_clock::now();
+    FigureStats phases{};
+
+    Robot robot(robotName, 0, HEIGHT);
+    robot.rotate(startAngle(robotName));
+    StochasticLSystem* lSystem = createStochasticLSystem(robotName, gensNumber, FOREST_SEED);
+    // the word is rewritten generation by generation, its length is only known once it is done
+    std::shared_ptr<const std::vector<Module>> word = stochasticWord(robotName, lSystem, gensNumber, control);
+    if (word == nullptr or (control != nullptr and control->isCancelled)) {
+        delete lSystem;
+        return;
+    }
+    if (control != nullptr)
+        control->total = word->size();
+
+    figure.clear();
+    figure.setPrimitiveType(sf::LinesStrip);
+    phases.setupMs = millisecondsSince(phaseStart);
+    phaseStart = std::chrono::steady_clock::now();
+
+    // the arc-length gradient needs the steps of the whole figure up front, every drawing module is one
+    uint64_t steps = std::count_if(word->begin(), word->end(), [&](const Module& module) {
+        return lSystem->isDrawing(module.symbol);
+    });
+    Coloring coloring(colorMode, figureColor(robotName), steps);
+    if (tags != nullptr)
+        tags->clear();
+    auto onVertex = [&](double, double, bool isVisible) {
+        appendVertex(figure, &robot, &coloring, tags, isVisible);
+    };
+    uint8_t strip = interpretModules(*word, lSystem, &robot, onVertex, control);
+    if (control != nullptr and control->isCancelled) {
+        delete lSystem;
+        return;
+    }
+    // Add last vertex
+    endStrip(&robot, strip, onVertex);
+
+    phases.interpretMs = millisecondsSince(phaseStart);
+    if (removeDuplicates) {
+        phaseStart = std::chrono::steady_clock::now();
+        phases.duplicates = removeDuplicateSegments(figure, tags);
+        phases.dedupMs = millisecondsSince(phaseStart);
+    }
+    phases.segments = choosePrimitive(figure, tags);
+    phases.primitive = figure.getPrimitiveType();
+    phases.colorMode = colorMode;
+
+    if (stats != nullptr) {
+        phases.symbols = word->size();
+        phases.vertices = figure.getVertexCount();
+        phases.steps = steps;
+        phases.moves = steps;
+        phases.symbolBytes = word->capacity() * sizeof(Module);
+        phases.vertexBytes = figure.getVertexCount() * sizeof(sf::Vertex);
+        *stats = phases;
+    }
+
+    delete lSystem;
+}
+
+// With visibleArea set only the part of the figure inside it is built, down to pixelSize detail.
+// stats, when given, receives the timings of the build phases. control lets another thread follow
+// and cancel the build; a cancelled build leaves the figure incomplete. Vertices are colored
+// by colorMode as they are emitted; tags, when given, receives what CompactFigure::recolor() needs.
+// removeDuplicates drops the segments drawn more than once, see removeDuplicateSegments().
+inline void makeFigure(sf::VertexArray& figure, LSystem* lSystem, Robot* robot, const std::string& robotName, int gensNumber,
+                       const sf::FloatRect* visibleArea = nullptr, float pixelSize = 0, FigureStats* stats = nullptr,
+                       BuildControl* control = nullptr, ColorMode colorMode = ColorMode::Flat,
+                       std::vector<VertexTag>* tags = nullptr, bool removeDuplicates = false) {
+    if (isStochastic(robotName)) {
+        makeStochasticFigure(figure, robotName, gensNumber, stats, control, colorMode, tags, removeDuplicates);
+        return;
+    }
+
+    auto phaseStart = std::chrono::steady_clock::now();
+    FigureStats phases{};
+
+    lSystem = createLSystem(robotName, gensNumber);
+    robot = new Robot(robotName, 0, HEIGHT);
+    placeRobot(robot, robotName, lSystem);
+
+    figure.clear();
+    figure.setPrimitiveType(sf::LinesStrip);
+    if (tags != nullptr)
+        tags->clear();
+    bool useMemory = usesMemory(robotName);
+    // the arc-length gradient needs the steps of the whole figure up front
+    MacroStep whole = MacroSteps(lSystem, useMemory).compose(lSystem->getInitAxiom(), gensNumber);
+    Coloring coloring(colorMode, figureColor(robotName), whole.moves);
+    phases.setupMs = millisecondsSince(phaseStart);
+    phaseStart = std::chrono::steady_clock::now();
+
+    uint64_t symbolsNumber = lSystem->getExpandedLength(lSystem->getInitAxiom(), gensNumber);
+    int parts = partsNumber(symbolsNumber, MIN_PARALLEL_CHUNK);
+    if (control != nullptr and visibleArea == nullptr)
+        control->total = symbolsNumber;
+    if (visibleArea != nullptr) {
+        makeFigureInView(figure, lSystem, robot, useMemory, *visibleArea, pixelSize, control, &coloring, tags);
+    } else if (parts > 1) {
+        makeFigureParallel(figure, lSystem, robot, robotName, useMemory, parts, control, &coloring, tags);
+    } else {
+        makeFigureSerial(figure, lSystem, robot, useMemory, control, &coloring, tags);
+    }
+
+    if (control != nullptr and control->isCancelled) {
+        delete lSystem;
+        delete robot;
+        return;
+    }
+
+    phases.interpretMs = millisecondsSince(phaseStart);
+    if (removeDuplicates) {
+        phaseStart = std::chrono::steady_clock::now();
+        phases.duplicates = removeDuplicateSegments(figure, tags);
+        phases.dedupMs = millisecondsSince(phaseStart);
+    }
+    phases.segments = choosePrimitive(figure, tags);
+    phases.primitive = figure.getPrimitiveType();
+    phases.colorMode = colorMode;
+
+    if (stats != nullptr) {
+        phases.symbols = lSystem->getExpandedLength(lSystem->getInitAxiom(), gensNumber);
+        phases.vertices = figure.getVertexCount();
+        phases.steps = whole.moves;
+        phases.moves = visibleArea == nullptr ? whole.moves : 0;
+        phases.symbolBytes = lSystem->getMemoryUsage();
+        phases.vertexBytes = figure.getVertexCount() * sizeof(sf::Vertex);
+        *stats = phases;
+    }
+
+    delete lSystem;
+    delete robot;
+}
+
+#endif //SPBU_SEMESTER1_FRACTALS_FIGURE_H
@@ -0,0 +1,109 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_LRU_H
+#define SPBU_SEMESTER1_FRACTALS_LRU_H
+
+#include <list>
+#include <map>
+#include <cstddef>
+
+template <typename Key, typename Value>
+struct LruEntry {
+    Value value;
+    size_t bytes;
+    typename std::list<Key>::iterator lruPos;
+};
+
+// Values by key within a budget of bytes; the least recently used ones are dropped first.
+// Map holds the entries: a std::map by default, so neighbouring keys can be looked up, or an
+// unordered_map of LruEntry. There is no locking, the owner guards it with its own mutex.
+template <typename Key, typename Value, typename Map = std::map<Key, LruEntry<Key, Value>>>
+class LruCache {
+private:
+    size_t byteBudget;
+    size_t bytesUsed;
+    Map entries;
+    // most recently used first
+    std::list<Key> order;
+public:
+    explicit LruCache(size_t _byteBudget) {
+        byteBudget = _byteBudget;
+        bytesUsed = 0;
+    }
+
+    // Value of key, nullptr when there is none; it isn't marked as used
+    Value* find(const Key& key) {
+        auto it = entries.find(key);
+        return it == entries.end() ? nullptr : &it->second.value;
+    }
+
+    // Value of key marked as the most recently used, nullptr when there is none
+    Value* use(const Key& key) {
+        auto it = entries.find(key);
+        if (it == entries.end())
+            return nullptr;
+        order.splice(order.begin(), order, it->second.lruPos);
+        return &it->second.value;
+    }
+
+    // Adds the value as the most recently used one; false when key is there already or the
+    // value is over the whole budget, which would only push everything else out. Nothing is
+    // dropped here, see trim().
+    bool insert(const Key& key, const Value& value, size_t bytes) {
+        if (entries.count(key) or bytes > byteBudget)
+            return false;
+        order.push_front(key);
+        entries[key] = LruEntry<Key, Value>{value, bytes, order.begin()};
+        bytesUsed += bytes;
+        return true;
+    }
+
+    void erase(const Key& key) {
+        auto it = entries.find(key);
+        if (it == entries.end())
+            return;
+        bytesUsed -= it->second.bytes;
+        order.erase(it->second.lruPos);
+        entries.erase(it);
+    }
+
+    // Drops least recently used entries until the rest fits the budget. drop(value) releases
+    // what the value holds and returns true, or returns false to keep an entry still in use.
+    template <typename Drop>
+    void trim(Drop drop) {
+        auto lruPos = order.end();
+        while (bytesUsed > byteBudget and lruPos != order.begin()) {
+            --lruPos;
+            auto it = entries.find(*lruPos);
+            if (!drop(it->second.value))
+                continue;
+            bytesUsed -= it->second.bytes;
+            entries.erase(it);
+            lruPos = order.erase(lruPos);
+        }
+    }
+
+    // Values held through shared pointers stay alive where they are still in use
+    void trim() {
+        trim([](Value&) { return true; });
+    }
+
+    // Drops every entry, calling drop(value) on each
+    template <typename Drop>
+    void clear(Drop drop) {
+        for (auto& entry : entries) {
+            drop(entry.second.value);
+        }
+        clear();
+    }
+
+    void clear() {
+        entries.clear();
+        order.clear();
+        bytesUsed = 0;
+    }
+
+    // The entries by key, to look up neighbours of a key in an ordered Map
+    [[nodiscard]] const Map& getEntries() const { return entries; }
+    [[nodiscard]] size_t getBytesUsed() const { return bytesUsed; }
+};
+
+#endif //SPBU_SEMESTER1_FRACTALS_LRU_H
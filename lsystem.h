@@ -0,0 +1,247 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_LSYSTEM_H
+#define SPBU_SEMESTER1_FRACTALS_LSYSTEM_H
+
+#include <string>
+#include <vector>
+#include <array>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "settings.h"
+#include "parallel.h"
+
+class LSystem {
+private:
+    std::string axiom, initAxiom;
+    // second half of the ping-pong pair used by applyRules()
+    std::string buffer;
+    // '+' and '-' are swapped when the word is read, the word itself stays as rewritten
+    bool isInverse;
+    // productions[c] is what c is rewritten to; symbols without a rule map to themselves
+    std::array<std::string, 256> productions;
+    std::array<bool, 256> isRewritten;
+    // symbols the robot draws a segment for
+    std::array<bool, 256> isDrawingSymbol;
+    int angle, gens;
+    // lengths[depth][c] is the length of symbol c after depth rewrites
+    std::vector<std::array<uint64_t, 256>> lengths;
+
+    void init(const std::string& _axiom, const std::vector<std::pair<char, std::string>>& rules,
+              const std::string& drawingSymbols, int _angle, int _gens) {
+        axiom = _axiom;
+        initAxiom = axiom;
+        isInverse = false;
+        angle = _angle;
+        gens = _gens;
+
+        for (int c = 0; c < 256; ++c) {
+            productions[c] = std::string(1, char(c));
+            isRewritten[c] = false;
+            isDrawingSymbol[c] = false;
+        }
+        for (const std::pair<char, std::string>& rule : rules) {
+            productions[(unsigned char)rule.first] = rule.second;
+            isRewritten[(unsigned char)rule.first] = true;
+        }
+        for (char c : drawingSymbols) {
+            isDrawingSymbol[(unsigned char)c] = true;
+        }
+
+        buildLengths();
+    }
+
+    void buildLengths() {
+        lengths.assign(std::max(gens, 1) + 1, std::array<uint64_t, 256>());
+        lengths[0].fill(1);
+        for (int depth = 1; depth < int(lengths.size()); ++depth) {
+            for (int c = 0; c < 256; ++c) {
+                uint64_t length = 0;
+                for (char r : productions[c]) {
+                    length += lengths[depth - 1][(unsigned char)r];
+                }
+                lengths[depth][c] = length;
+            }
+        }
+    }
+public:
+    // Any number of rules; the robot draws a segment for every symbol in drawingSymbols
+    LSystem(std::string _axiom, const std::vector<std::pair<char, std::string>>& rules, const std::string& drawingSymbols,
+            int _angle, int _gens) {
+        init(_axiom, rules, drawingSymbols, _angle, _gens);
+    }
+
+    // Two rules, both rewritten symbols are drawn
+    LSystem(std::string _axiom, char _chr1, char _chr2, std::string _rule1, std::string _rule2,
+             int _angle, int _gens) {
+        init(_axiom, {{_chr1, _rule1}, {_chr2, _rule2}}, std::string() + _chr1 + _chr2, _angle, _gens);
+    }
+
+    LSystem(std::string _axiom, char _chr1, std::string _rule1, int _angle, int _gensNumber) {
+        init(_axiom, {{_chr1, _rule1}}, std::string(1, _chr1), _angle, _gensNumber);
+    }
+
+    // One rewrite of the whole word. Every part of the word knows its exact output
+    // length from the length table, so the parts are written by separate threads
+    // straight into the presized buffer.
+    void applyRules() {
+        const std::array<uint64_t, 256>& ruleLength = lengths[1];
+        int parts = partsNumber(axiom.size(), MIN_PARALLEL_CHUNK);
+        std::vector<size_t> offsets(parts + 1, 0);
+
+        auto partBegin = [&](int part) { return axiom.size() * part / parts; };
+
+        runParallel(parts, [&](int part) {
+            size_t length = 0;
+            for (size_t i = partBegin(part); i < partBegin(part + 1); ++i) {
+                length += ruleLength[(unsigned char)axiom[i]];
+            }
+            offsets[part + 1] = length;
+        });
+        for (int part = 0; part < parts; ++part) {
+            offsets[part + 1] += offsets[part];
+        }
+
+        buffer.resize(offsets[parts]);
+        // every symbol has a production, so the hot loop has no branches
+        runParallel(parts, [&](int part) {
+            char* out = &buffer[0] + offsets[part];
+            for (size_t i = partBegin(part); i < partBegin(part + 1); ++i) {
+                const std::string& production = productions[(unsigned char)axiom[i]];
+                memcpy(out, production.data(), production.size());
+                out += production.size();
+            }
+        });
+
+        axiom.swap(buffer);
+    }
+
+    // Swaps '+' and '-' in what getAxiom() returns
+    void inverseAxiom() {
+        isInverse = !isInverse;
+    }
+
+    void generate() {
+        // both halves of the ping-pong pair get the final size up front
+        uint64_t finalLength = getExpandedLength(axiom, gens);
+        axiom.reserve(finalLength);
+        buffer.reserve(finalLength);
+
+        for (int gen = 1; gen <= gens; ++gen) {
+            applyRules();
+        }
+
+        if (gens % 2 == 0) {
+            inverseAxiom();
+        }
+    }
+
+    // Rule body for c, or nullptr when c is not rewritten
+    [[nodiscard]] const std::string* getRule(char c) const {
+        return isRewritten[(unsigned char)c] ? &productions[(unsigned char)c] : nullptr;
+    }
+
+    [[nodiscard]] bool isDrawing(char c) const { return isDrawingSymbol[(unsigned char)c]; }
+
+    // Length of symbol c after depth rewrites
+    [[nodiscard]] uint64_t getExpandedLength(char c, int depth) const {
+        return lengths[depth][(unsigned char)c];
+    }
+
+    [[nodiscard]] uint64_t getExpandedLength(const std::string& word, int depth) const {
+        uint64_t length = 0;
+        for (char c : word) {
+            length += getExpandedLength(c, depth);
+        }
+        return length;
+    }
+
+    [[nodiscard]] std::string getAxiom() const {
+        std::string word = axiom;
+        if (isInverse) {
+            for (char &c : word) {
+                if (c == '-')
+                    c = '+';
+                else if (c == '+')
+                    c = '-';
+            }
+        }
+        return word;
+    }
+    [[nodiscard]] const std::string& getInitAxiom() const { return initAxiom; }
+    [[nodiscard]] int getGens() const { return gens; }
+    [[nodiscard]] int getAngle() const { return angle; }
+
+    // Bytes held by the words and the length table
+    [[nodiscard]] size_t getMemoryUsage() const {
+        size_t bytes = axiom.capacity() + initAxiom.capacity() + buffer.capacity() + sizeof(productions) +
+                       lengths.capacity() * sizeof(std::array<uint64_t, 256>);
+        for (const std::string& production : productions) {
+            bytes += production.capacity();
+        }
+        return bytes;
+    }
+};
+
+// Depth-first generator over the symbols of the final generation.
+// Rules are expanded on demand, so only one frame per generation is kept
+// instead of the whole rewritten string.
+class LSystemStream {
+private:
+    struct Frame {
+        const std::string* word;
+        size_t pos;
+    };
+
+    const LSystem* lSystem;
+    std::vector<Frame> frames;
+    int depth;
+    bool isInverse;
+public:
+    explicit LSystemStream(const LSystem* _lSystem) {
+        lSystem = _lSystem;
+        depth = lSystem->getGens();
+        frames.reserve(depth + 1);
+        frames.push_back({&lSystem->getInitAxiom(), 0});
+        // same parity rule as LSystem::generate()
+        isInverse = lSystem->getGens() % 2 == 0;
+    }
+
+    // Symbols of `word` after `_depth` more rewrites
+    LSystemStream(const LSystem* _lSystem, const std::string* word, int _depth, bool _isInverse) {
+        lSystem = _lSystem;
+        depth = _depth;
+        frames.reserve(depth + 1);
+        frames.push_back({word, 0});
+        isInverse = _isInverse;
+    }
+
+    bool next(char& c) {
+        while (!frames.empty()) {
+            Frame& top = frames.back();
+            if (top.pos == top.word->size()) {
+                frames.pop_back();
+                continue;
+            }
+
+            c = (*top.word)[top.pos++];
+            const std::string* rule = lSystem->getRule(c);
+            if (rule != nullptr and int(frames.size()) <= depth) {
+                frames.push_back({rule, 0});
+                continue;
+            }
+
+            if (isInverse) {
+                if (c == '-')
+                    c = '+';
+                else if (c == '+')
+                    c = '-';
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+#endif //SPBU_SEMESTER1_FRACTALS_LSYSTEM_H
@@ -1,154 +1,18 @@
 #include <SFML/Graphics.hpp>
 #include <string>
-#include <cmath>
-#include <stack>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 
-// system settings
-const int WIDTH = 1600, HEIGHT = 900;
-const double PI = acos(-1);
-const int step = 3;
-
-class LSystem {
-private:
-    std::string axiom;
-    char chr1, chr2;
-    std::string rule1, rule2;
-    int angle, gens;
-public:
-    LSystem(std::string _axiom, char _chr1, char _chr2, std::string _rule1, std::string _rule2,
-             int _angle, int _gens) {
-        axiom = _axiom;
-        chr1 = _chr1;
-        chr2 = _chr2;
-        rule1 = _rule1;
-        rule2 = _rule2;
-        angle = _angle;
-        gens = _gens;
-
-        generate();
-    }
-
-    LSystem(std::string _axiom, char _chr1, std::string _rule1, int _angle, int _gensNumber) {
-        axiom = _axiom;
-        chr1 = _chr1;
-        chr2 = '#';
-        rule1 = _rule1;
-        rule2 = "";
-        angle = _angle;
-        gens = _gensNumber;
-
-        generate();
-    }
-
-    void applyRules() {
-        std::string res;
-        for (char c : axiom) {
-            if (c == chr1)
-                res += rule1;
-            else if (c == chr2)
-                res += rule2;
-            else
-                res += c;
-        }
-
-        axiom = res;
-    }
-
-    void inverseAxiom() {
-        for (char &c : axiom) {
-            if (c == '-')
-                c = '+';
-            else if (c == '+')
-                c = '-';
-        }
-    }
-
-    void generate() {
-        for (int gen = 1; gen <= gens; ++gen) {
-            applyRules();
-        }
-
-        if (gens % 2 == 0) {
-            inverseAxiom();
-        }
-    }
-
-    [[nodiscard]] std::string getAxiom() const { return axiom; }
-    [[nodiscard]] int getGens() const { return gens; }
-    [[nodiscard]] char getChr1() const { return chr1; }
-    [[nodiscard]] char getChr2() const { return chr2; }
-    [[nodiscard]] int getAngle() const { return angle; }
-};
-
-struct RobotData {
-    double x, y;
-    double angle; // in degrees
-};
-
-class Robot {
-private:
-    std::string name;
-    double beginX, beginY;
-    double endX, endY;
-    double angle; // in degrees
-
-    std::stack<RobotData> *memory;
-
-    void updateEndCoords() {
-        double angle_rad = angle * 2 * PI / 360;
-        endX = beginX + 1 * cos(angle_rad);
-        endY = beginY - 1 * sin(angle_rad);
-    }
-public:
-    Robot(std::string _name, double _beginX, double _beginY, double _endX, double _endY) {
-        name = _name;
-        beginX = _beginX;
-        endX = _endX;
-        beginY = _beginY;
-        endY = _endY;
-        angle = 0;
-
-        memory = new std::stack<RobotData>();
-    }
-
-    void move() {
-        double angle_rad = angle * 2 * PI / 360;
-        double dx = step * cos(angle_rad);
-        double dy = step * sin(angle_rad);
-        beginX = beginX + dx;
-        beginY = beginY - dy;
-        updateEndCoords();
-    }
-
-    void rotate(int phi) {
-        angle += phi;
-        updateEndCoords();
-    }
-
-    void setBeginX(double new_begin_x) {
-        beginX = new_begin_x;
-        updateEndCoords();
-    }
-
-    void setBeginY(double new_begin_y) {
-        beginY = new_begin_y;
-        updateEndCoords();
-    }
-
-    void setAngle(double new_angle) {
-        angle = new_angle;
-        updateEndCoords();
-    }
-
-    [[nodiscard]] double getBeginX() const { return beginX; }
-    [[nodiscard]] double getEndX() const { return endX; }
-    [[nodiscard]] double getBeginY() const { return beginY; }
-    [[nodiscard]] double getEndY() const { return endY; }
-    [[nodiscard]] double getAngle() const { return angle; }
-    [[nodiscard]] std::string getName() const { return name; }
-    [[nodiscard]] std::stack<RobotData>* getMemory() const { return memory; }
-};
+#include "settings.h"
+#include "figure.h"
+#include "raster.h"
+#include "tiles.h"
+#include "builder.h"
+#include "buffers.h"
+#include "compact.h"
+#include "spatial.h"
 
 class TextButton {
 private:
@@ -341,6 +205,8 @@ public:
     }
 
     void updateSFMLText() {
+        delete textField;
+
         textField = new sf::Text(text, font, 20);
         textField->setColor(sf::Color::Black);
         textField->setPosition(x, y);
@@ -376,6 +242,206 @@ public:
     }
 };
 
+// Toggleable overlay with the phase timings of the last figure build and a
+// histogram of the recent frame times
+class PerformanceHud {
+private:
+    static const size_t FRAMES_NUMBER = 240;
+    // 1 ms buckets, the last one also holds everything slower
+    static const int BUCKETS_NUMBER = 40;
+
+    std::vector<TextField*> lines;
+    std::vector<float> frameTimes;
+    size_t nextFrame;
+    FigureStats stats;
+    float drawMs;
+    // what is under the mouse
+    std::string picked;
+    sf::Clock refreshClock;
+    sf::RectangleShape panel;
+    sf::VertexArray histogram;
+
+    static std::string formatMs(double ms) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.2f ms", ms);
+        return buffer;
+    }
+
+    static std::string formatBytes(size_t bytes) {
+        char buffer[32];
+        if (bytes >= (size_t(1) << 20))
+            snprintf(buffer, sizeof(buffer), "%.1f MB", bytes / 1048576.0);
+        else
+            snprintf(buffer, sizeof(buffer), "%.1f KB", bytes / 1024.0);
+        return buffer;
+    }
+
+    float percentile(double p) const {
+        std::vector<float> sorted(frameTimes);
+        size_t k = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        return sorted[k];
+    }
+
+    void refresh() {
+        std::string build = stats.isCached ? "build: loaded from cache in " + formatMs(stats.setupMs)
+                                           : "build: setup " + formatMs(stats.setupMs) + ", expand + turtle + color " +
+                                             formatMs(stats.interpretMs);
+        if (stats.dedupMs > 0)
+            build += ", dedup " + formatMs(stats.dedupMs);
+        lines[0]->setText(build);
+        lines[1]->setText("draw: " + formatMs(drawMs));
+        std::string vertices = "symbols: " + std::to_string(stats.symbols) + ", vertices: " + std::to_string(stats.vertices);
+        if (stats.segments > 0) {
+            vertices += std::string(stats.primitive == sf::Lines ? " as lines" : " as a strip") +
+                        ", segments: " + std::to_string(stats.segments);
+            char ratio[64];
+            double segments = double(stats.segments);
+            if (stats.moves > 0)
+                snprintf(ratio, sizeof(ratio), " (%.2f vertices and %.2f steps each)",
+                         double(stats.vertices) / segments, double(stats.moves) / segments);
+            else
+                snprintf(ratio, sizeof(ratio), " (%.2f vertices each)", double(stats.vertices) / segments);
+            vertices += ratio;
+        }
+        if (stats.dedupMs > 0 or stats.duplicates > 0)
+            vertices += ", duplicates removed: " + std::to_string(stats.duplicates);
+        lines[2]->setText(vertices);
+        lines[3]->setText("memory: symbols " + formatBytes(stats.symbolBytes) + ", vertices " + formatBytes(stats.vertexBytes));
+        if (!frameTimes.empty()) {
+            lines[4]->setText("frame: p50 " + formatMs(percentile(0.5)) + ", p99 " + formatMs(percentile(0.99)));
+        }
+        lines[5]->setText(picked);
+
+        std::vector<int> counts(BUCKETS_NUMBER, 0);
+        for (float ms : frameTimes) {
+            ++counts[std::min(BUCKETS_NUMBER - 1, int(ms))];
+        }
+        int maxCount = std::max(1, *std::max_element(counts.begin(), counts.end()));
+
+        const float left = 20, bottom = 250, barWidth = 10, maxHeight = 60;
+        histogram.clear();
+        for (int bucket = 0; bucket < BUCKETS_NUMBER; ++bucket) {
+            float height = maxHeight * counts[bucket] / maxCount;
+            float x = left + bucket * barWidth;
+            // slower than 60 fps is red
+            sf::Color color = bucket < 17 ? sf::Color(0, 150, 0) : sf::Color(200, 0, 0);
+            histogram.append(sf::Vertex(sf::Vector2f(x, bottom), color));
+            histogram.append(sf::Vertex(sf::Vector2f(x + barWidth - 1, bottom), color));
+            histogram.append(sf::Vertex(sf::Vector2f(x + barWidth - 1, bottom - height), color));
+            histogram.append(sf::Vertex(sf::Vector2f(x, bottom - height), color));
+        }
+    }
+public:
+    PerformanceHud() : histogram(sf::Quads) {
+        for (int i = 0; i < 6; ++i) {
+            lines.push_back(new TextField("", 20, 10 + 28 * i, 560, 28));
+        }
+        frameTimes.reserve(FRAMES_NUMBER);
+        nextFrame = 0;
+        stats = FigureStats{};
+        drawMs = 0;
+
+        panel.setPosition(10, 10);
+        panel.setSize(sf::Vector2f(580, 250));
+        panel.setFillColor(sf::Color(255, 255, 255, 210));
+    }
+
+    void setFigureStats(const FigureStats& _stats) { stats = _stats; }
+    void setPicked(const std::string& _picked) { picked = _picked; }
+
+    void addFrame(float frameMs, float _drawMs) {
+        drawMs = _drawMs;
+        if (frameTimes.size() < FRAMES_NUMBER) {
+            frameTimes.push_back(frameMs);
+        } else {
+            frameTimes[nextFrame] = frameMs;
+        }
+        nextFrame = (nextFrame + 1) % FRAMES_NUMBER;
+    }
+
+    // Draws in window coordinates, whatever the current view is
+    void draw(sf::RenderWindow& app) {
+        // text is rebuilt a few times per second only
+        if (refreshClock.getElapsedTime().asMilliseconds() >= 250) {
+            refreshClock.restart();
+            refresh();
+        }
+
+        sf::View view = app.getView();
+        app.setView(app.getDefaultView());
+        app.draw(panel);
+        for (TextField* line : lines) {
+            app.draw(line->getSFMLText());
+        }
+        app.draw(histogram);
+        app.setView(view);
+    }
+};
+
+// Pixels from the mouse a segment can be picked at
+const float PICK_RADIUS = 4;
+
+// The word of the figure on screen, for describePick(). Its macro-steps take O(rules * gens) to
+// build, so they are built once per finished figure rather than on every mouse move.
+class PickContext {
+private:
+    std::string robotName;
+    int gensNumber;
+    LSystem* lSystem;
+    MacroSteps* macroSteps;
+public:
+    PickContext() {
+        gensNumber = 0;
+        lSystem = nullptr;
+        macroSteps = nullptr;
+    }
+
+    PickContext(const PickContext&) = delete;
+    PickContext& operator=(const PickContext&) = delete;
+
+    ~PickContext() { clear(); }
+
+    // Builds the lookups for a figure, unless they are there already (a view of the same figure)
+    void set(const std::string& _robotName, int _gensNumber) {
+        if (_robotName == robotName and _gensNumber == gensNumber)
+            return;
+        clear();
+        robotName = _robotName;
+        gensNumber = _gensNumber;
+        lSystem = createLSystem(robotName, gensNumber);
+        if (lSystem != nullptr)
+            macroSteps = new MacroSteps(lSystem, usesMemory(robotName));
+    }
+
+    void clear() {
+        delete macroSteps;
+        delete lSystem;
+        macroSteps = nullptr;
+        lSystem = nullptr;
+        robotName.clear();
+        gensNumber = 0;
+    }
+
+    // False for stochastic figures, they have no fixed word to point into
+    [[nodiscard]] bool hasWord() const { return lSystem != nullptr; }
+
+    // Index in the expanded word of the symbol that makes step `wanted`, see symbolOfStep()
+    [[nodiscard]] uint64_t symbolOf(uint64_t wanted) const { return symbolOfStep(lSystem, *macroSteps, wanted); }
+};
+
+// Which segment of the figure is under point, and which symbol of the expanded word draws it
+std::string describePick(const CompactFigure& figure, const FigureIndex& index, const MappedArray<VertexTag>& tags,
+                         const PickContext& context, sf::Vector2f point, float radius) {
+    size_t segment = index.pick(figure, point.x, point.y, radius);
+    if (segment == 0)
+        return "under mouse: nothing";
+    std::string text = "under mouse: segment " + std::to_string(segment);
+    if (context.hasWord() and segment - 1 < tags.size())
+        text += ", symbol " + std::to_string(context.symbolOf(tags[segment - 1].arc));
+    return text;
+}
+
 std::pair<std::string, int> menu(sf::RenderWindow& app) {
     sf::View view(sf::FloatRect(0, 0, WIDTH, HEIGHT));
     view.setViewport(sf::FloatRect(0, 0, 1, 1));
@@ -389,12 +455,15 @@ std::pair<std::string, int> menu(sf::RenderWindow& app) {
 
     bool isStringInputFromKeyboard = true;
 
-    TextButton *triangleTextButton, *kochsTextButton, *plantTextButton, *curveTextButton;
+    TextButton *triangleTextButton, *kochsTextButton, *plantTextButton, *curveTextButton, *hogewegTextButton,
+            *forestTextButton;
 
     triangleTextButton = new TextButton("Sierpinski triangle",120, 140, 300, 50);
     kochsTextButton = new TextButton("Koch's snowflake",120, 190, 300, 50);
     plantTextButton = new TextButton("Plant",120, 240, 300, 50);
     curveTextButton = new TextButton("Dragon curve",120, 290, 300, 50);
+    hogewegTextButton = new TextButton("Hogeweg plant",120, 340, 300, 50);
+    forestTextButton = new TextButton("Forest",120, 390, 300, 50);
 
     int untouchableSymbols = gensNumberTextField->getTextSize() - (int)std::string("(input from keyboard)").size();
 
@@ -404,6 +473,8 @@ std::pair<std::string, int> menu(sf::RenderWindow& app) {
         kochsTextButton->changeColorOnHover();
         plantTextButton->changeColorOnHover();
         curveTextButton->changeColorOnHover();
+        hogewegTextButton->changeColorOnHover();
+        forestTextButton->changeColorOnHover();
 
         sf::Event event;
         while (app.pollEvent(event)) {
@@ -413,6 +484,8 @@ std::pair<std::string, int> menu(sf::RenderWindow& app) {
             kochsTextButton->changeFocusOnHover(mousePosition);
             plantTextButton->changeFocusOnHover(mousePosition);
             curveTextButton->changeFocusOnHover(mousePosition);
+            hogewegTextButton->changeFocusOnHover(mousePosition);
+            forestTextButton->changeFocusOnHover(mousePosition);
 
             switch (event.type) {
                 case sf::Event::Closed:
@@ -470,6 +543,28 @@ std::pair<std::string, int> menu(sf::RenderWindow& app) {
                             isWarning = false;
                             return std::make_pair(curveTextButton->getText(), gensNumber);
                         }
+                    } else if (hogewegTextButton->haveFocus()) {
+                        if (gensNumber <= 0) {
+                            isWarning = true;
+                            warningTextField->setText("<--- Incorrect input");
+                        } else if (gensNumber >= 41) {
+                            isWarning = true;
+                            warningTextField->setText("<--- Too big number");
+                        } else {
+                            isWarning = false;
+                            return std::make_pair(hogewegTextButton->getText(), gensNumber);
+                        }
+                    } else if (forestTextButton->haveFocus()) {
+                        if (gensNumber <= 0) {
+                            isWarning = true;
+                            warningTextField->setText("<--- Incorrect input");
+                        } else if (gensNumber >= 13) {
+                            isWarning = true;
+                            warningTextField->setText("<--- Too big number");
+                        } else {
+                            isWarning = false;
+                            return std::make_pair(forestTextButton->getText(), gensNumber);
+                        }
                     }
                     break;
                 }
@@ -505,78 +600,86 @@ std::pair<std::string, int> menu(sf::RenderWindow& app) {
         app.draw(kochsTextButton->getSFMLText());
         app.draw(plantTextButton->getSFMLText());
         app.draw(curveTextButton->getSFMLText());
+        app.draw(hogewegTextButton->getSFMLText());
+        app.draw(forestTextButton->getSFMLText());
 
         if (isWarning)
             app.draw(warningTextField->getSFMLText());
 
         app.display();
     }
+    return std::make_pair(std::string(), 0);
 }
 
-void fillColorFigure(sf::VertexArray& figure, sf::Color color) {
-    for (int i = 0; i < figure.getVertexCount(); ++i) {
-        figure[i].color = color;
+// Renders the whole figure fitted into width x height pixels and saves it as an image.
+// Uses only the software rasterizer, so it works without a window, a display or a GPU,
+// at sizes beyond any texture limit.
+int renderToFile(const std::string& robotName, int gensNumber, unsigned width, unsigned height, const std::string& path,
+                 int samples = 1) {
+    sf::VertexArray strip(sf::LinesStrip);
+    LSystem* lSystem = nullptr;
+    sf::FloatRect bounds;
+    if (isStochastic(robotName)) {
+        // the whole figure has to be expanded anyway, so it is measured after building
+        makeStochasticFigure(strip, robotName, gensNumber);
+        bounds = strip.getBounds();
+    } else {
+        lSystem = createLSystem(robotName, gensNumber);
+        if (lSystem == nullptr) {
+            std::cerr << "Unknown fractal: " << robotName << std::endl;
+            return 1;
+        }
+        RobotData start{0, HEIGHT, double(startAngle(robotName))};
+        MacroSteps macroSteps(lSystem, usesMemory(robotName));
+        bounds = MacroSteps::bounds(macroSteps.compose(lSystem->getInitAxiom(), gensNumber), start);
     }
-}
 
-void makeFigure(sf::VertexArray& figure, LSystem* lSystem, Robot* robot, const std::string& robotName, int gensNumber) {
-
-    robot = new Robot(robotName, 0, HEIGHT, 1, HEIGHT);
-    if (robotName == "Plant") {
-        lSystem = new LSystem("X", 'X', 'F', "F-[[X]+X]+F[+FX]-X", "FF", 25, gensNumber);
-        robot->rotate(45);
-    } else if (robotName == "Sierpinski triangle") {
-        lSystem = new LSystem("A", 'A', 'B', "B-A-B", "A+B+A", 60, gensNumber);
-    } else if (robotName == "Dragon curve") {
-        lSystem = new LSystem("FX", 'X', 'Y', "X+YF+", "-FX-Y", 90, gensNumber);
-    } else if (robotName == "Koch's snowflake") {
-        lSystem = new LSystem("F++F++F", 'F', "F-F++F-F", 60, gensNumber);
-    }
-
-    figure.clear();
-
-    RobotData newPos;
-    for (char c : lSystem->getAxiom()) {
-        if (c == lSystem->getChr1()) {
-            figure.append(sf::Vector2f(robot->getBeginX(), robot->getBeginY()));
-            robot->move();
-        } else if (c == lSystem->getChr2()) {
-            figure.append(sf::Vector2f(robot->getBeginX(), robot->getBeginY()));
-            robot->move();
-        } else if (c == '-') {
-            robot->rotate(+lSystem->getAngle());
-        } else if (c == '+') {
-            robot->rotate(-lSystem->getAngle());
-        } else if (c == '[') {
-            if (robotName == "Plant") {
-                robot->getMemory()->push({robot->getBeginX(), robot->getBeginY(), robot->getAngle()});
-            }
-        } else if (c == ']') {
-            if (robotName == "Plant") {
-                newPos = robot->getMemory()->top();
-                robot->getMemory()->pop();
-                robot->setBeginX(newPos.x);
-                robot->setBeginY(newPos.y);
-                robot->setAngle(newPos.angle);
-            }
-        }
+    // world units per pixel, keeping a small margin around the figure
+    const double margin = 0.02;
+    double scale = std::max(bounds.width / (width * (1 - 2 * margin)), bounds.height / (height * (1 - 2 * margin)));
+    if (scale <= 0)
+        scale = 1;
+    double left = bounds.left + bounds.width / 2 - width * scale / 2;
+    double top = bounds.top + bounds.height / 2 - height * scale / 2;
+    sf::FloatRect area(float(left), float(top), float(width * scale), float(height * scale));
+
+    if (lSystem != nullptr) {
+        Robot robot(robotName, 0, HEIGHT);
+        placeRobot(&robot, robotName, lSystem);
+        makeFigureInView(strip, lSystem, &robot, usesMemory(robotName), area, float(scale / samples));
+        delete lSystem;
     }
 
-    // Add last vertex
-    figure.append(sf::Vector2f(robot->getBeginX(), robot->getBeginY()));
+    std::vector<sf::Uint8> pixels;
+    rasterizeParallel(strip, left, top, scale, figureColor(robotName), sf::Color::Black, width, height, samples, pixels);
 
-    if (robotName == "Dragon curve") {
-        fillColorFigure(figure, sf::Color::Red);
-    } else if (robotName == "Koch's snowflake"){
-        fillColorFigure(figure, sf::Color::Blue);
-    } else if (robotName == "Plant") {
-        fillColorFigure(figure, sf::Color::Green);
-    } else if (robotName == "Sierpinski triangle") {
-        fillColorFigure(figure, sf::Color::Green);
+    sf::Image image;
+    image.create(width, height, pixels.data());
+    if (!image.saveToFile(path)) {
+        std::cerr << "Can't write " << path << std::endl;
+        return 1;
     }
+    return 0;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // Headless mode: --render <fractal> <generations> <width> <height> <output image> [samples]
+    if (argc > 1) {
+        if ((argc != 7 and argc != 8) or std::string(argv[1]) != "--render") {
+            std::cerr << "Usage: " << argv[0]
+                      << " --render <fractal> <generations> <width> <height> <output image> [samples]" << std::endl;
+            return 1;
+        }
+        int gensNumber = atoi(argv[3]);
+        int width = atoi(argv[4]), height = atoi(argv[5]);
+        int samples = argc == 8 ? atoi(argv[7]) : 1;
+        if (gensNumber <= 0 or width <= 0 or height <= 0 or samples <= 0 or samples > 16) {
+            std::cerr << "Generations, width and height must be positive numbers, samples from 1 to 16" << std::endl;
+            return 1;
+        }
+        return renderToFile(argv[2], gensNumber, unsigned(width), unsigned(height), argv[6], samples);
+    }
+
     sf::RenderWindow app(sf::VideoMode(WIDTH, HEIGHT,64),"Fractal");
     sf::View view = app.getDefaultView();
 //
@@ -584,11 +687,26 @@ int main() {
 //    std::string robotName = robotNameAndGensNumber.first;
 //    int gensNumber = robotNameAndGensNumber.second;
 
-    Robot* robot;
-    LSystem *LSystem;
-    sf::VertexArray figure(sf::LinesStrip);
-
-    makeFigure(figure, LSystem, robot, "Sierpinski triangle", 8);
+    CompactFigure figure;
+    // only the chunks of the figure in view are drawn, and the mouse picks segments through it
+    FigureIndex index;
+    std::vector<std::pair<size_t, size_t>> visibleRanges;
+    // what the figure was built from, so C can recolor it without building it again
+    MappedArray<VertexTag> tags;
+    ColorMode colorMode = ColorMode::Flat;
+    // D drops the segments the figure draws more than once
+    bool removeDuplicates = false;
+
+    std::string robotName = "Sierpinski triangle";
+    int gensNumber = 8;
+    FigureStats stats{};
+    // figures are built in the background, the window keeps drawing the last finished one
+    FigureBuilder builder;
+    builder.request(robotName, gensNumber, nullptr, 0, colorMode, removeDuplicates);
+    // the finished figure lives on the GPU, so a redraw doesn't upload it again
+    StaticFigure staticFigure;
+    // set when a figure arrives, so picking a segment doesn't rebuild the word's macro-steps
+    PickContext pickContext;
 
 //    sf::Texture loupeTexture;
 //    loupeTexture.loadFromFile("./img/loupe.png");
@@ -603,79 +721,159 @@ int main() {
     bool moving = false;
     bool after_menu = false;
     float zoom = 1;
-    bool isLoupe = false;
+    // the figure only holds what was visible when it was built
+    bool isViewChanged = false;
+
+    // T switches between drawing the figure and compositing tiles rendered in the background;
+    // stochastic figures can't be tiled and are drawn whole either way
+    TileRenderer tiles(size_t(256) << 20);
+    tiles.setFigure(robotName, gensNumber, colorMode);
+    bool isTiled = false;
+
+    // H shows the performance overlay
+    PerformanceHud hud;
+    bool isHud = false;
+    sf::Clock frameClock;
     while(app.isOpen()){
         sf::Event event;
         while(app.pollEvent(event)) {
             switch (event.type) {
                 case sf::Event::KeyPressed:
-//                    if (event.key.code == sf::Keyboard::Escape) {
-//                        std::pair<std::string, int> newRobotNameAndNewGensNumber = menu(app);
-//                        const std::string newRobotName = newRobotNameAndNewGensNumber.first;
-//                        int newGensNumber = newRobotNameAndNewGensNumber.second;
-//                        after_menu = true;
-//
-//                        oldPos = sf::Vector2f(0, 0);
-//                        makeFigure(figure, LSystem, robot, newRobotName, newGensNumber);
-//                    }
+                    if (event.key.code == sf::Keyboard::T) {
+                        isTiled = !isTiled;
+                    } else if (event.key.code == sf::Keyboard::H) {
+                        isHud = !isHud;
+                    } else if (event.key.code == sf::Keyboard::C) {
+                        colorMode = ColorMode((int(colorMode) + 1) % COLOR_MODES_NUMBER);
+                        figure.recolor(tags.data(), tags.size(), Coloring(colorMode, figureColor(robotName), stats.steps));
+                        stats.colorMode = colorMode;
+                        staticFigure.set(figure);
+                        tiles.setColorMode(colorMode);
+                    } else if (event.key.code == sf::Keyboard::D) {
+                        removeDuplicates = !removeDuplicates;
+                        isViewChanged = true;
+                    } else if (event.key.code == sf::Keyboard::Escape) {
+                        std::pair<std::string, int> newRobotNameAndNewGensNumber = menu(app);
+                        if (!app.isOpen())
+                            break;
+                        robotName = newRobotNameAndNewGensNumber.first;
+                        gensNumber = newRobotNameAndNewGensNumber.second;
+                        after_menu = true;
+
+                        oldPos = sf::Vector2f(0, 0);
+                        zoom = 1;
+                        view = app.getDefaultView();
+                        app.setView(view);
+                        // cancels the build of the previous figure if it is still running
+                        builder.request(robotName, gensNumber, nullptr, 0, colorMode, removeDuplicates);
+                        tiles.setFigure(robotName, gensNumber, colorMode);
+                    }
 
                     break;
                 case sf::Event::Closed:
                     app.close();
                     break;
                 case sf::Event::MouseButtonPressed:
-//                    moving = true;
-//                    oldPos = app.mapPixelToCoords(sf::Vector2i(event.mouseButton.x, event.mouseButton.y));
+                    moving = true;
+                    oldPos = app.mapPixelToCoords(sf::Vector2i(event.mouseButton.x, event.mouseButton.y));
                     break;
                 case sf::Event::MouseButtonReleased:
-//                    moving = false;
-//                    oldPos = app.mapPixelToCoords(sf::Vector2i(event.mouseButton.x, event.mouseButton.y));
+                    moving = false;
+                    isViewChanged = true;
+                    oldPos = app.mapPixelToCoords(sf::Vector2i(event.mouseButton.x, event.mouseButton.y));
                     break;
                 case sf::Event::MouseMoved: {
-//                    if (!moving)
-//                        break;
-//
-//                    sf::Vector2f newPos = app.mapPixelToCoords(sf::Vector2i(event.mouseMove.x, event.mouseMove.y));
-//
-//                    sf::Vector2f deltaPos = newPos - oldPos;
-//
-//
-//                    if (after_menu) {
-//                        view.setCenter(sf::Vector2f(WIDTH / 2, HEIGHT / 2));
-//                        after_menu = false;
-//                    } else {
-//                        view.setCenter(view.getCenter() - deltaPos);
-//                    }
-//
-//                    app.setView(view);
-//
-//                    oldPos = app.mapPixelToCoords(sf::Vector2i(event.mouseMove.x, event.mouseMove.y));
+                    if (!moving) {
+                        if (isHud)
+                            hud.setPicked(describePick(figure, index, tags, pickContext,
+                                                       app.mapPixelToCoords(sf::Vector2i(event.mouseMove.x, event.mouseMove.y)),
+                                                       PICK_RADIUS * view.getSize().x / WIDTH));
+                        break;
+                    }
+
+                    sf::Vector2f newPos = app.mapPixelToCoords(sf::Vector2i(event.mouseMove.x, event.mouseMove.y));
+
+                    sf::Vector2f deltaPos = newPos - oldPos;
+
+
+                    if (after_menu) {
+                        view.setCenter(sf::Vector2f(WIDTH / 2, HEIGHT / 2));
+                        after_menu = false;
+                    } else {
+                        view.setCenter(view.getCenter() - deltaPos);
+                    }
+
+                    app.setView(view);
+
+                    oldPos = app.mapPixelToCoords(sf::Vector2i(event.mouseMove.x, event.mouseMove.y));
                     break;
                 } case sf::Event::MouseWheelScrolled: {
-//                    if (moving)
-//                        break;
-//
-//                    if (event.mouseWheelScroll.delta >= 1) {
-//                        zoom = std::max(0.5f, zoom - 0.1f);
-//
-//                    } else if (event.mouseWheelScroll.delta <= -1) {
-//                        zoom = std::min(2.f, zoom + 0.1f);
-//                    }
-//
-//                    isLoupe = true;
-//
-//                    view.setSize(app.getDefaultView().getSize());
-//                    view.zoom(zoom);
-//
-//                    app.setView(view);
+                    if (moving)
+                        break;
+
+                    // culling keeps deep zoom cheap, so the zoom is no longer clamped at 0.5
+                    if (event.mouseWheelScroll.delta >= 1) {
+                        zoom = std::max(0.001f, zoom * 0.8f);
+
+                    } else if (event.mouseWheelScroll.delta <= -1) {
+                        zoom = std::min(2.f, zoom / 0.8f);
+                    }
+
+                    view.setSize(app.getDefaultView().getSize());
+                    view.zoom(zoom);
+
+                    app.setView(view);
+                    isViewChanged = true;
                     break;
                 }
            }
         }
 
+        bool drawsTiles = isTiled and tiles.canDraw();
+        if (isViewChanged and !moving and !drawsTiles) {
+            isViewChanged = false;
+            sf::FloatRect visibleArea(view.getCenter() - view.getSize() / 2.f, view.getSize());
+            builder.request(robotName, gensNumber, &visibleArea, view.getSize().x / WIDTH, colorMode,
+                            removeDuplicates);
+        }
+        if (builder.poll(figure, index, tags, stats)) {
+            pickContext.set(robotName, gensNumber);
+            // the build was requested before the color mode last changed
+            if (stats.colorMode != colorMode) {
+                figure.recolor(tags.data(), tags.size(), Coloring(colorMode, figureColor(robotName), stats.steps));
+                stats.colorMode = colorMode;
+            }
+            staticFigure.set(figure);
+        }
+        if (!drawsTiles) {
+            index.query(sf::FloatRect(view.getCenter() - view.getSize() / 2.f, view.getSize()), visibleRanges);
+            staticFigure.setVisibleRanges(visibleRanges);
+        }
+
         app.clear(sf::Color::Black);
 
-        app.draw(figure);
+        sf::Clock drawClock;
+        if (drawsTiles) {
+            tiles.draw(app, view);
+        } else {
+            app.draw(staticFigure);
+        }
+        float drawMs = drawClock.getElapsedTime().asMicroseconds() / 1000.f;
+
+        // progress bar over the top edge while a figure is being built
+        if (builder.isBuilding() and !drawsTiles) {
+            float progress = builder.getProgress();
+            sf::RectangleShape bar(sf::Vector2f(WIDTH * (progress < 0 ? 1 : progress), 4));
+            bar.setFillColor(progress < 0 ? sf::Color(255, 255, 255, 80) : sf::Color::White);
+            app.setView(app.getDefaultView());
+            app.draw(bar);
+            app.setView(view);
+        }
+
+        if (isHud) {
+            hud.setFigureStats(stats);
+            hud.draw(app);
+        }
 
         // TO DO
 //        if (isLoupe) {
@@ -683,6 +881,7 @@ int main() {
 //            app.draw(loupeSprite);
 //        }
         app.display();
+        hud.addFrame(frameClock.restart().asMicroseconds() / 1000.f, drawMs);
     }
 
     return 0;
@@ -0,0 +1,107 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_PARALLEL_H
+#define SPBU_SEMESTER1_FRACTALS_PARALLEL_H
+
+#include <thread>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+// Shared by a figure built in the background and the thread waiting for it
+struct BuildControl {
+    std::atomic<bool> isCancelled{false};
+    // symbols interpreted so far out of the expected total, 0 when the total is unknown
+    std::atomic<uint64_t> done{0}, total{0};
+};
+
+// Symbols between two looks at BuildControl, so the hot loops stay cheap
+const uint64_t BUILD_CHECK_INTERVAL = 1 << 16;
+
+inline int threadsNumber() {
+    int n = int(std::thread::hardware_concurrency());
+    return n > 0 ? n : 1;
+}
+
+// Number of parts to split `count` items into, so that each part is at least `minChunk` long
+inline int partsNumber(size_t count, size_t minChunk) {
+    size_t parts = count / minChunk;
+    if (parts < 1)
+        return 1;
+    return int(std::min(parts, size_t(threadsNumber())));
+}
+
+// Runs body(part) for every part in [0, parts), the last one on the calling thread
+template <typename Func>
+void runParallel(int parts, Func body) {
+    std::vector<std::thread> workers;
+    workers.reserve(parts);
+    for (int part = 0; part + 1 < parts; ++part) {
+        workers.emplace_back(body, part);
+    }
+    if (parts > 0)
+        body(parts - 1);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+// Fixed-size set of worker threads running submitted tasks in order
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable hasTasks;
+    bool isStopped;
+
+    void work() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                hasTasks.wait(lock, [this] { return isStopped or !tasks.empty(); });
+                if (isStopped)
+                    return;
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+public:
+    explicit ThreadPool(int threads) {
+        isStopped = false;
+        for (int i = 0; i < threads; ++i) {
+            workers.emplace_back([this] { work(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Tasks still waiting in the queue are dropped
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            isStopped = true;
+        }
+        hasTasks.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    void submit(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        hasTasks.notify_one();
+    }
+};
+
+#endif //SPBU_SEMESTER1_FRACTALS_PARALLEL_H
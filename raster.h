@@ -0,0 +1,172 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_RASTER_H
+#define SPBU_SEMESTER1_FRACTALS_RASTER_H
+
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#include "settings.h"
+#include "parallel.h"
+
+// Calls plot(px, py) for every pixel of the segment (x0, y0) - (x1, y1) that falls inside a
+// width x height buffer. The segment is clipped first, culled segments can be far away, but
+// the steps follow the whole segment, so a segment split over several buffers hits the same pixels.
+template <typename Plot>
+void traceSegment(double x0, double y0, double x1, double y1, unsigned width, unsigned height, Plot plot) {
+    // Liang-Barsky clipping
+    double t0 = 0, t1 = 1;
+    double dx = x1 - x0, dy = y1 - y0;
+    double p[4] = {-dx, dx, -dy, dy};
+    double q[4] = {x0 + 1, width - x0, y0 + 1, height - y0};
+    for (int k = 0; k < 4; ++k) {
+        if (p[k] == 0) {
+            if (q[k] < 0)
+                return;
+        } else if (p[k] < 0) {
+            t0 = std::max(t0, q[k] / p[k]);
+        } else {
+            t1 = std::min(t1, q[k] / p[k]);
+        }
+    }
+    if (t0 > t1)
+        return;
+
+    double steps = std::ceil(std::max(std::fabs(dx), std::fabs(dy)));
+    double stepX = steps == 0 ? 0 : dx / steps, stepY = steps == 0 ? 0 : dy / steps;
+    long from = long(std::floor(t0 * steps)), to = long(std::ceil(t1 * steps));
+    for (long k = from; k <= to; ++k) {
+        long px = long(std::floor(x0 + k * stepX)), py = long(std::floor(y0 + k * stepY));
+        if (px >= 0 and py >= 0 and px < long(width) and py < long(height))
+            plot(px, py);
+    }
+}
+
+// False for the segments of a strip that jump between branches, their ends are transparent
+inline bool isDrawn(const sf::Vertex& a, const sf::Vertex& b) {
+    return a.color.a != 0 and b.color.a != 0;
+}
+
+// Whether vertex i > 0 of a figure ends the segment that starts at vertex i - 1: every one does
+// in a line strip, every second one in sf::Lines
+inline bool isSegmentEnd(sf::PrimitiveType type, size_t i) {
+    return type != sf::Lines or i % 2 == 1;
+}
+
+// Draws a line strip (or sf::Lines) into an RGBA buffer of width x height pixels, every segment
+// in the color of its first vertex. Vertices are given in world coordinates; (left, top) maps to
+// pixel (0, 0) and scale is world units per pixel.
+inline void rasterizeStrip(const sf::VertexArray& strip, double left, double top, double scale,
+                           unsigned width, unsigned height, std::vector<sf::Uint8>& pixels) {
+    for (size_t i = 1; i < strip.getVertexCount(); ++i) {
+        if (!isSegmentEnd(strip.getPrimitiveType(), i) or !isDrawn(strip[i - 1], strip[i]))
+            continue;
+        sf::Color color = strip[i - 1].color;
+        traceSegment((strip[i - 1].position.x - left) / scale, (strip[i - 1].position.y - top) / scale,
+                     (strip[i].position.x - left) / scale, (strip[i].position.y - top) / scale,
+                     width, height, [&](long px, long py) {
+            sf::Uint8* p = &pixels[(size_t(py) * width + size_t(px)) * 4];
+            p[0] = color.r;
+            p[1] = color.g;
+            p[2] = color.b;
+            p[3] = color.a;
+        });
+    }
+}
+
+// Framebuffer pixels per side of a tile of the software rasterizer
+const unsigned RASTER_TILE = 256;
+
+// Multi-threaded software rasterizer for framebuffers of any size, with no GPU involved.
+// Segments are binned per framebuffer tile, then every tile is drawn by one thread into a
+// coverage mask with `samples` x `samples` samples per pixel and box-filtered down into
+// pixels, blending color over background. With samples = 1 the colors are exact.
+// strip is a line strip or sf::Lines.
+inline void rasterizeParallel(const sf::VertexArray& strip, double left, double top, double scale,
+                              sf::Color color, sf::Color background, unsigned width, unsigned height, int samples,
+                              std::vector<sf::Uint8>& pixels) {
+    pixels.resize(size_t(width) * height * 4);
+    size_t tilesX = (width + RASTER_TILE - 1) / RASTER_TILE, tilesY = (height + RASTER_TILE - 1) / RASTER_TILE;
+    size_t segments = strip.getVertexCount() > 0 ? strip.getVertexCount() - 1 : 0;
+
+    // bins[part][tile] holds the segments of one binning thread that touch the tile
+    int parts = partsNumber(segments, MIN_PARALLEL_CHUNK);
+    std::vector<std::vector<std::vector<uint32_t>>> bins(parts, std::vector<std::vector<uint32_t>>(tilesX * tilesY));
+    runParallel(parts, [&](int part) {
+        for (size_t i = segments * part / parts; i < segments * (part + 1) / parts; ++i) {
+            if (!isSegmentEnd(strip.getPrimitiveType(), i + 1) or !isDrawn(strip[i], strip[i + 1]))
+                continue;
+            double x0 = (strip[i].position.x - left) / scale, y0 = (strip[i].position.y - top) / scale;
+            double x1 = (strip[i + 1].position.x - left) / scale, y1 = (strip[i + 1].position.y - top) / scale;
+            double minX = std::max(0.0, std::min(x0, x1) - 1), maxX = std::min(width - 1.0, std::max(x0, x1) + 1);
+            double minY = std::max(0.0, std::min(y0, y1) - 1), maxY = std::min(height - 1.0, std::max(y0, y1) + 1);
+            if (minX > maxX or minY > maxY)
+                continue;
+            for (size_t ty = size_t(minY) / RASTER_TILE; ty <= size_t(maxY) / RASTER_TILE; ++ty) {
+                for (size_t tx = size_t(minX) / RASTER_TILE; tx <= size_t(maxX) / RASTER_TILE; ++tx) {
+                    bins[part][ty * tilesX + tx].push_back(uint32_t(i));
+                }
+            }
+        }
+    });
+
+    const unsigned area = unsigned(samples * samples);
+    std::atomic<size_t> nextTile(0);
+    runParallel(threadsNumber(), [&](int) {
+        std::vector<sf::Uint8> coverage;
+        std::vector<uint16_t> sums;
+        for (size_t tile = nextTile++; tile < tilesX * tilesY; tile = nextTile++) {
+            unsigned x0 = unsigned(tile % tilesX) * RASTER_TILE, y0 = unsigned(tile / tilesX) * RASTER_TILE;
+            unsigned w = std::min(RASTER_TILE, width - x0), h = std::min(RASTER_TILE, height - y0);
+            unsigned sw = w * samples, sh = h * samples;
+            coverage.assign(size_t(sw) * sh, 0);
+
+            // lines stay a pixel wide, so a sample square is set around every traced sample
+            double sampleScale = scale / samples;
+            double offsetX = double(x0) * samples, offsetY = double(y0) * samples;
+            for (const std::vector<std::vector<uint32_t>>& partBins : bins) {
+                for (uint32_t i : partBins[tile]) {
+                    traceSegment((strip[i].position.x - left) / sampleScale - offsetX,
+                                 (strip[i].position.y - top) / sampleScale - offsetY,
+                                 (strip[i + 1].position.x - left) / sampleScale - offsetX,
+                                 (strip[i + 1].position.y - top) / sampleScale - offsetY,
+                                 sw, sh, [&](long px, long py) {
+                        long fromX = std::max(0L, px - samples / 2), toX = std::min(long(sw), px - samples / 2 + samples);
+                        long fromY = std::max(0L, py - samples / 2), toY = std::min(long(sh), py - samples / 2 + samples);
+                        for (long y = fromY; y < toY; ++y) {
+                            memset(&coverage[size_t(y) * sw + fromX], 1, toX - fromX);
+                        }
+                    });
+                }
+            }
+
+            // Box filter: plain loops over rows of samples, which the compiler vectorizes
+            sums.resize(w);
+            for (unsigned y = 0; y < h; ++y) {
+                std::fill(sums.begin(), sums.end(), 0);
+                for (int sy = 0; sy < samples; ++sy) {
+                    const sf::Uint8* row = &coverage[size_t(y * samples + sy) * sw];
+                    for (int sx = 0; sx < samples; ++sx) {
+                        for (unsigned x = 0; x < w; ++x) {
+                            sums[x] += row[x * samples + sx];
+                        }
+                    }
+                }
+
+                sf::Uint8* out = &pixels[(size_t(y0 + y) * width + x0) * 4];
+                for (unsigned x = 0; x < w; ++x) {
+                    unsigned c = sums[x], b = area - c;
+                    out[x * 4 + 0] = sf::Uint8((color.r * c + background.r * b) / area);
+                    out[x * 4 + 1] = sf::Uint8((color.g * c + background.g * b) / area);
+                    out[x * 4 + 2] = sf::Uint8((color.b * c + background.b * b) / area);
+                    out[x * 4 + 3] = sf::Uint8((color.a * c + background.a * b) / area);
+                }
+            }
+        }
+    });
+}
+
+#endif //SPBU_SEMESTER1_FRACTALS_RASTER_H
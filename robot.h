@@ -0,0 +1,280 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_ROBOT_H
+#define SPBU_SEMESTER1_FRACTALS_ROBOT_H
+
+#include <string>
+#include <stack>
+#include <array>
+#include <cmath>
+
+#include "settings.h"
+
+struct RobotData {
+    double x, y;
+    double angle; // in degrees
+};
+
+// One step along every integer heading, in screen coordinates (y grows downwards)
+struct Direction {
+    double dx, dy;
+};
+
+inline const std::array<Direction, 360>& directions() {
+    static const std::array<Direction, 360> table = [] {
+        std::array<Direction, 360> res{};
+        for (int deg = 0; deg < 360; ++deg) {
+            double angle_rad = deg * 2 * PI / 360;
+            res[deg] = {step * cos(angle_rad), -step * sin(angle_rad)};
+        }
+        return res;
+    }();
+    return table;
+}
+
+// One step along a heading of a lattice, in lattice coordinates
+struct LatticeStep {
+    int64_t a, b;
+};
+
+// Lattice a system with this angle keeps its robot on: 90 for the square grid, 60 for the
+// triangular one (Eisenstein integers), 0 when its headings don't form a lattice
+inline int latticeAngle(int angle) {
+    if (angle % 90 == 0)
+        return 90;
+    if (angle % 60 == 0)
+        return 60;
+    return 0;
+}
+
+class Robot {
+private:
+    std::string name;
+    double beginX, beginY;
+    double angle; // in degrees
+    // angle mod 360 while the angle stays integer, used to index directions()
+    int heading;
+    bool isIntegerAngle;
+
+    // On a lattice the position is origin + a * (step, 0) + b * (wx, wy), where (wx, wy) is a
+    // step at the lattice angle. Integer steps don't drift, and the position is only turned
+    // into doubles when it is read. lattice is 0 when there is none; off it the robot goes on
+    // in doubles until setData() brings it back.
+    int lattice;
+    bool onLattice;
+    double originX, originY, wx, wy;
+    int64_t a, b;
+    // steps made since the start, in every branch; returning from a branch doesn't undo them
+    uint64_t steps;
+
+    std::stack<RobotData> *memory;
+
+    static const LatticeStep& latticeStep(int lattice, int heading) {
+        static const LatticeStep square[4] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+        static const LatticeStep triangular[6] = {{1, 0}, {0, 1}, {-1, 1}, {-1, 0}, {0, -1}, {1, -1}};
+        return lattice == 90 ? square[heading / 90] : triangular[heading / 60];
+    }
+
+    void leaveLattice() {
+        if (!onLattice)
+            return;
+        beginX = getBeginX();
+        beginY = getBeginY();
+        onLattice = false;
+    }
+public:
+    Robot(std::string _name, double _beginX, double _beginY) {
+        name = _name;
+        beginX = _beginX;
+        beginY = _beginY;
+        angle = 0;
+        heading = 0;
+        isIntegerAngle = true;
+        lattice = 0;
+        onLattice = false;
+        originX = originY = wx = wy = 0;
+        a = b = 0;
+        steps = 0;
+
+        memory = new std::stack<RobotData>();
+    }
+
+    Robot(const Robot&) = delete;
+    Robot& operator=(const Robot&) = delete;
+
+    ~Robot() { delete memory; }
+
+    void move() {
+        ++steps;
+        if (onLattice) {
+            const LatticeStep& d = latticeStep(lattice, heading);
+            a += d.a;
+            b += d.b;
+            return;
+        }
+        if (isIntegerAngle) {
+            const Direction& d = directions()[heading];
+            beginX += d.dx;
+            beginY += d.dy;
+            return;
+        }
+
+        double angle_rad = angle * 2 * PI / 360;
+        double dx = step * cos(angle_rad);
+        double dy = step * sin(angle_rad);
+        beginX = beginX + dx;
+        beginY = beginY - dy;
+    }
+
+    // Moves `length` steps along the current angle
+    void move(double length) {
+        ++steps;
+        leaveLattice();
+        if (isIntegerAngle) {
+            const Direction& d = directions()[heading];
+            beginX += d.dx * length;
+            beginY += d.dy * length;
+            return;
+        }
+
+        double angle_rad = angle * 2 * PI / 360;
+        beginX += step * length * cos(angle_rad);
+        beginY -= step * length * sin(angle_rad);
+    }
+
+    void rotate(int phi) {
+        if (onLattice and phi % lattice != 0)
+            leaveLattice();
+        angle += phi;
+        heading = ((heading + phi) % 360 + 360) % 360;
+    }
+
+    // Puts the robot on the lattice of the given angle (see latticeAngle()) with its origin at
+    // (originX, originY). The robot stays on it while it turns by multiples of the angle and
+    // moves whole steps, and setData() brings it back onto it.
+    void useLattice(int _lattice, double _originX, double _originY) {
+        leaveLattice();
+        lattice = _lattice == 90 or _lattice == 60 ? _lattice : 0;
+        originX = _originX;
+        originY = _originY;
+        wx = lattice == 90 ? 0 : step * 0.5;
+        wy = lattice == 90 ? -step : -step * sqrt(3.0) / 2;
+        setData({beginX, beginY, angle});
+    }
+
+    // Puts the robot on the same lattice as other
+    void useLattice(const Robot& other) {
+        useLattice(other.lattice, other.originX, other.originY);
+    }
+
+    void setBeginX(double new_begin_x) {
+        leaveLattice();
+        beginX = new_begin_x;
+    }
+
+    void setBeginY(double new_begin_y) {
+        leaveLattice();
+        beginY = new_begin_y;
+    }
+
+    // For walks that skip steps or start partway through the figure
+    void setSteps(uint64_t _steps) {
+        steps = _steps;
+    }
+
+    void setData(const RobotData& data) {
+        onLattice = false;
+        beginX = data.x;
+        beginY = data.y;
+        setAngle(data.angle);
+        if (lattice != 0 and isIntegerAngle and heading % lattice == 0) {
+            // the position came through doubles, the nearest lattice point is the exact one
+            b = llround((data.y - originY) / wy);
+            a = llround((data.x - originX - b * wx) / step);
+            onLattice = true;
+        }
+    }
+
+    void setAngle(double new_angle) {
+        angle = new_angle;
+        isIntegerAngle = (new_angle == floor(new_angle));
+        if (isIntegerAngle) {
+            heading = (int(fmod(new_angle, 360)) + 360) % 360;
+        }
+        if (onLattice and !(isIntegerAngle and heading % lattice == 0))
+            leaveLattice();
+    }
+
+    [[nodiscard]] double getBeginX() const { return onLattice ? originX + a * step + b * wx : beginX; }
+    [[nodiscard]] double getEndX() const { return getBeginX() + cos(angle * 2 * PI / 360); }
+    [[nodiscard]] double getBeginY() const { return onLattice ? originY + b * wy : beginY; }
+    [[nodiscard]] double getEndY() const { return getBeginY() - sin(angle * 2 * PI / 360); }
+    [[nodiscard]] double getAngle() const { return angle; }
+    [[nodiscard]] RobotData getData() const { return {getBeginX(), getBeginY(), angle}; }
+    // Exact lattice coordinates, meaningful while isOnLattice()
+    [[nodiscard]] bool isOnLattice() const { return onLattice; }
+    [[nodiscard]] int getLattice() const { return lattice; }
+    [[nodiscard]] int64_t getLatticeA() const { return a; }
+    [[nodiscard]] int64_t getLatticeB() const { return b; }
+    [[nodiscard]] int getHeading() const { return heading; }
+    [[nodiscard]] uint64_t getSteps() const { return steps; }
+    [[nodiscard]] bool hasIntegerAngle() const { return isIntegerAngle; }
+    [[nodiscard]] std::string getName() const { return name; }
+    [[nodiscard]] std::stack<RobotData>* getMemory() const { return memory; }
+};
+
+// How the line strip of a figure stands, as flags. Straight runs of steps are merged into
+// one segment: a step that goes on in the heading of the previous one needs no vertex.
+// All branches share the strip: it jumps back after ']' between two hidden vertices
+// (onVertex(x, y, false)), which are drawn transparent, and a run of ']' costs one jump.
+// the robot moved since the last vertex, the end of its last step is still to be emitted
+const uint8_t STRIP_MOVED = 1;
+// the robot came back from a branch, the next vertex needs a hidden one before it
+const uint8_t STRIP_JUMPING = 2;
+// the robot turned since its last step
+const uint8_t STRIP_TURNED = 4;
+const int STRIP_STATES = 8;
+
+// Vertices addVertex() emits in the given strip state
+inline uint64_t stepVertices(uint8_t strip) {
+    if (strip == STRIP_MOVED)
+        return 0;
+    return (strip & STRIP_JUMPING) ? 2 : 1;
+}
+
+// Vertices endStrip() emits in the given strip state
+inline uint64_t lastVertices(uint8_t strip) {
+    return (strip & STRIP_JUMPING) ? 2 : 1;
+}
+
+// Emits what the strip needs before the robot makes a step: nothing when the step goes straight on
+template <typename OnVertex>
+void addVertex(const Robot* robot, uint8_t& strip, OnVertex onVertex) {
+    if (strip == STRIP_MOVED)
+        return;
+    if (strip & STRIP_JUMPING)
+        onVertex(robot->getBeginX(), robot->getBeginY(), false);
+    onVertex(robot->getBeginX(), robot->getBeginY(), true);
+    strip = STRIP_MOVED;
+}
+
+// Emits the last vertex of the figure
+template <typename OnVertex>
+void endStrip(const Robot* robot, uint8_t strip, OnVertex onVertex) {
+    if (strip & STRIP_JUMPING)
+        onVertex(robot->getBeginX(), robot->getBeginY(), false);
+    onVertex(robot->getBeginX(), robot->getBeginY(), true);
+}
+
+// Handles ']': ends the branch where the robot stands, if it moved, and returns the robot
+// to where the branch began
+template <typename OnVertex>
+void closeBranch(Robot* robot, uint8_t& strip, OnVertex onVertex) {
+    if (strip & STRIP_MOVED) {
+        onVertex(robot->getBeginX(), robot->getBeginY(), true);
+        onVertex(robot->getBeginX(), robot->getBeginY(), false);
+    }
+    robot->setData(robot->getMemory()->top());
+    robot->getMemory()->pop();
+    strip = STRIP_JUMPING;
+}
+
+#endif //SPBU_SEMESTER1_FRACTALS_ROBOT_H
@@ -0,0 +1,22 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_SETTINGS_H
+#define SPBU_SEMESTER1_FRACTALS_SETTINGS_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// system settings
+const int WIDTH = 1600, HEIGHT = 900;
+const double PI = acos(-1);
+const int step = 3;
+// smallest piece of work worth handing to a separate thread
+const size_t MIN_PARALLEL_CHUNK = 1 << 16;
+// bytes of expanded words kept between builds of stochastic figures
+const size_t GENERATION_CACHE_BYTES = size_t(256) << 20;
+// directory of the figures cached on disk, and bytes of them kept mapped between builds
+const char* const GEOMETRY_CACHE_DIRECTORY = "cache";
+const size_t GEOMETRY_CACHE_BYTES = size_t(512) << 20;
+// bytes of cache files kept on disk, the least recently used ones are deleted first
+const uint64_t GEOMETRY_CACHE_DISK_BYTES = uint64_t(4) << 30;
+
+#endif //SPBU_SEMESTER1_FRACTALS_SETTINGS_H
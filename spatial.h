@@ -0,0 +1,201 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_SPATIAL_H
+#define SPBU_SEMESTER1_FRACTALS_SPATIAL_H
+
+#include <SFML/Graphics.hpp>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+#include "settings.h"
+#include "parallel.h"
+#include "raster.h"
+#include "compact.h"
+
+// Vertices per leaf of a FigureIndex
+const size_t INDEX_LEAF = 256;
+
+// Bounding volume hierarchy over the segments of a finished line strip. A leaf bounds a run of
+// INDEX_LEAF consecutive vertices and every other node two neighbouring nodes of the level
+// below. The strip wanders off slowly, so neighbours in it are neighbours on screen too and
+// the tree needs no sorting. The hidden jumps between branches are left out of the boxes.
+class FigureIndex {
+private:
+    struct Box {
+        float minX, minY, maxX, maxY;
+
+        [[nodiscard]] bool isEmpty() const { return minX > maxX; }
+
+        void add(const Box& other) {
+            minX = std::min(minX, other.minX);
+            minY = std::min(minY, other.minY);
+            maxX = std::max(maxX, other.maxX);
+            maxY = std::max(maxY, other.maxY);
+        }
+
+        void add(const sf::Vector2f& point) {
+            add(Box{point.x, point.y, point.x, point.y});
+        }
+
+        [[nodiscard]] bool touches(const sf::FloatRect& area) const {
+            return !isEmpty() and minX <= area.left + area.width and area.left <= maxX and
+                   minY <= area.top + area.height and area.top <= maxY;
+        }
+
+        // 0 for a point inside
+        [[nodiscard]] float distance(float x, float y) const {
+            if (isEmpty())
+                return std::numeric_limits<float>::infinity();
+            float dx = std::max(std::max(minX - x, x - maxX), 0.f);
+            float dy = std::max(std::max(minY - y, y - maxY), 0.f);
+            return std::sqrt(dx * dx + dy * dy);
+        }
+    };
+
+    static Box empty() {
+        float inf = std::numeric_limits<float>::infinity();
+        return {inf, inf, -inf, -inf};
+    }
+
+    // levels[0] holds the leaves, the last level the root
+    std::vector<std::vector<Box>> levels;
+    size_t vertexCount;
+
+    static float segmentDistance(const sf::Vector2f& a, const sf::Vector2f& b, float x, float y) {
+        float dx = b.x - a.x, dy = b.y - a.y;
+        float length = dx * dx + dy * dy;
+        float t = length > 0 ? std::min(1.f, std::max(0.f, ((x - a.x) * dx + (y - a.y) * dy) / length)) : 0;
+        float px = a.x + t * dx - x, py = a.y + t * dy - y;
+        return std::sqrt(px * px + py * py);
+    }
+
+    // Leaf k holds the segments ending at vertices k * INDEX_LEAF + 1 to (k + 1) * INDEX_LEAF
+    [[nodiscard]] size_t leafBegin(size_t leaf) const { return leaf * INDEX_LEAF; }
+    [[nodiscard]] size_t leafEnd(size_t leaf) const { return std::min(leafBegin(leaf) + INDEX_LEAF + 1, vertexCount); }
+
+    void collect(size_t level, size_t node, const sf::FloatRect& area,
+                 std::vector<std::pair<size_t, size_t>>& ranges) const {
+        if (!levels[level][node].touches(area))
+            return;
+        if (level == 0) {
+            // neighbouring leaves share a vertex
+            if (!ranges.empty() and ranges.back().second > leafBegin(node))
+                ranges.back().second = leafEnd(node);
+            else
+                ranges.emplace_back(leafBegin(node), leafEnd(node));
+            return;
+        }
+        for (size_t child = 2 * node; child < std::min(2 * node + 2, levels[level - 1].size()); ++child) {
+            collect(level - 1, child, area, ranges);
+        }
+    }
+
+    void nearest(size_t level, size_t node, const CompactFigure& figure, float x, float y,
+                 std::vector<sf::Vertex>& vertices, size_t& best, float& bestDistance) const {
+        if (levels[level][node].distance(x, y) > bestDistance)
+            return;
+        if (level == 0) {
+            size_t begin = leafBegin(node), count = leafEnd(node) - begin;
+            figure.expand(begin, count, vertices.data());
+            for (size_t i = 1; i < count; ++i) {
+                if (!isSegmentEnd(figure.getPrimitiveType(), begin + i) or !isDrawn(vertices[i - 1], vertices[i]))
+                    continue;
+                float distance = segmentDistance(vertices[i - 1].position, vertices[i].position, x, y);
+                if (distance <= bestDistance) {
+                    bestDistance = distance;
+                    best = begin + i;
+                }
+            }
+            return;
+        }
+        // the closer child first, so the other one is more often skipped
+        size_t first = 2 * node, second = 2 * node + 1;
+        if (second >= levels[level - 1].size()) {
+            nearest(level - 1, first, figure, x, y, vertices, best, bestDistance);
+            return;
+        }
+        if (levels[level - 1][second].distance(x, y) < levels[level - 1][first].distance(x, y))
+            std::swap(first, second);
+        nearest(level - 1, first, figure, x, y, vertices, best, bestDistance);
+        nearest(level - 1, second, figure, x, y, vertices, best, bestDistance);
+    }
+public:
+    FigureIndex() {
+        vertexCount = 0;
+    }
+
+    // Indexes a line strip or sf::Lines. The leaves are bounded by all workers at once, and so are the
+    // wider levels above them.
+    void build(const CompactFigure& figure) {
+        clear();
+        vertexCount = figure.getVertexCount();
+        if (vertexCount < 2)
+            return;
+
+        size_t leaves = (vertexCount - 2) / INDEX_LEAF + 1;
+        levels.emplace_back(leaves);
+        int parts = partsNumber(vertexCount, MIN_PARALLEL_CHUNK);
+        runParallel(parts, [&](int part) {
+            std::vector<sf::Vertex> vertices(INDEX_LEAF + 1);
+            for (size_t leaf = leaves * part / parts; leaf < leaves * (part + 1) / parts; ++leaf) {
+                size_t begin = leafBegin(leaf), count = leafEnd(leaf) - begin;
+                figure.expand(begin, count, vertices.data());
+                Box box = empty();
+                for (size_t i = 1; i < count; ++i) {
+                    if (isSegmentEnd(figure.getPrimitiveType(), begin + i) and isDrawn(vertices[i - 1], vertices[i])) {
+                        box.add(vertices[i - 1].position);
+                        box.add(vertices[i].position);
+                    }
+                }
+                levels[0][leaf] = box;
+            }
+        });
+
+        while (levels.back().size() > 1) {
+            std::vector<Box> level((levels.back().size() + 1) / 2);
+            const std::vector<Box>& below = levels.back();
+            int levelParts = partsNumber(level.size(), MIN_PARALLEL_CHUNK);
+            runParallel(levelParts, [&](int part) {
+                for (size_t node = level.size() * part / levelParts; node < level.size() * (part + 1) / levelParts; ++node) {
+                    level[node] = below[2 * node];
+                    if (2 * node + 1 < below.size())
+                        level[node].add(below[2 * node + 1]);
+                }
+            });
+            levels.push_back(std::move(level));
+        }
+    }
+
+    // Vertex ranges [begin, end) of the figure, in order, that hold every drawn segment touching area
+    void query(const sf::FloatRect& area, std::vector<std::pair<size_t, size_t>>& ranges) const {
+        ranges.clear();
+        if (!levels.empty())
+            collect(levels.size() - 1, 0, area, ranges);
+    }
+
+    // The drawn segment of figure nearest to (x, y) and at most radius away from it, by the
+    // index of its end vertex; 0 when there is none. figure is the one the index was built for.
+    [[nodiscard]] size_t pick(const CompactFigure& figure, float x, float y, float radius) const {
+        size_t best = 0;
+        if (levels.empty())
+            return best;
+        std::vector<sf::Vertex> vertices(INDEX_LEAF + 1);
+        nearest(levels.size() - 1, 0, figure, x, y, vertices, best, radius);
+        return best;
+    }
+
+    void clear() {
+        levels.clear();
+        vertexCount = 0;
+    }
+
+    void swap(FigureIndex& other) {
+        levels.swap(other.levels);
+        std::swap(vertexCount, other.vertexCount);
+    }
+
+    [[nodiscard]] size_t getLeavesNumber() const { return levels.empty() ? 0 : levels[0].size(); }
+};
+
+#endif //SPBU_SEMESTER1_FRACTALS_SPATIAL_H
@@ -0,0 +1,396 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_STOCHASTIC_H
+#define SPBU_SEMESTER1_FRACTALS_STOCHASTIC_H
+
+#include <string>
+#include <vector>
+#include <array>
+#include <utility>
+#include <memory>
+#include <mutex>
+#include <iterator>
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <stdexcept>
+
+#include "settings.h"
+#include "parallel.h"
+#include "robot.h"
+#include "lru.h"
+
+// A symbol with its argument, the step length (in steps)
+struct Module {
+    char symbol;
+    float length;
+};
+
+// One weighted alternative of a stochastic rule. The lengths of the successor
+// modules are factors applied to the length of the rewritten module.
+// left and right, when set, are the symbols the neighbours must have for the rule to apply.
+struct Production {
+    double weight;
+    std::vector<Module> successor;
+    char left = 0, right = 0;
+};
+
+// Parses a word like "F(2)[+X(0.8)]" into modules; a missing argument is 1. A malformed
+// argument list, such as "F(2", "F(x)" or "F()", throws std::invalid_argument.
+inline std::vector<Module> parseModules(const std::string& word) {
+    auto fail = [&](size_t position, const std::string& what) {
+        throw std::invalid_argument("bad module word \"" + word + "\" at " + std::to_string(position) + ": " + what);
+    };
+
+    std::vector<Module> modules;
+    for (size_t i = 0; i < word.size(); ++i) {
+        if (word[i] == '(' or word[i] == ')')
+            fail(i, "a parenthesis with no symbol before it");
+        Module module{word[i], 1};
+        if (i + 1 < word.size() and word[i + 1] == '(') {
+            const char* begin = word.c_str() + i + 2;
+            char* end;
+            module.length = strtof(begin, &end);
+            if (end == begin or isspace((unsigned char)*begin) or !std::isfinite(module.length))
+                fail(i + 2, "the argument is not a number");
+            // the string ends in '\0', so a missing ')' is caught here too
+            if (*end != ')')
+                fail(size_t(end - word.c_str()), "')' expected");
+            i = end - word.c_str();
+        }
+        modules.push_back(module);
+    }
+    return modules;
+}
+
+// Random number in [0, 1) for the module at `position` of the word rewritten in generation `gen`.
+// It depends only on the position, never on the thread doing the rewrite, so the expansion
+// is the same for a given seed however it is split between threads.
+inline double positionRandom(uint64_t seed, int gen, uint64_t position) {
+    // splitmix64 finalizer
+    uint64_t x = seed ^ (uint64_t(gen) * 0x9E3779B97F4A7C15ULL) ^ (position * 0xD1B54A32D192ED03ULL);
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return double(x >> 11) / double(1ULL << 53);
+}
+
+// L-system with weighted alternative rules and modules carrying arguments
+class StochasticLSystem {
+private:
+    std::vector<Module> initAxiom, word, buffer;
+    // rules[c] is empty when c is not rewritten
+    std::array<std::vector<Production>, 256> rules;
+    std::array<double, 256> totalWeight;
+    std::array<bool, 256> isDrawingSymbol;
+    // symbols skipped when looking for the neighbours of a module
+    std::array<bool, 256> isIgnored;
+    bool hasContextRules;
+    int angle, gens;
+    uint64_t seed;
+
+    // Neighbours of every module in two linear passes. A branch sees the module before its '['
+    // as its left neighbour and has no right neighbour after its last module; the module
+    // before a '[' sees past the whole branch. One saved neighbour per open branch is kept.
+    // leftContext[i] and rightContext[i] get the neighbours of module i, 0 if none.
+    void findContexts(const std::vector<Module>& modules, std::vector<char>& leftContext,
+                      std::vector<char>& rightContext) const {
+        size_t n = modules.size();
+        leftContext.resize(n);
+        rightContext.resize(n);
+        std::vector<char> saved;
+
+        char last = 0;
+        for (size_t i = 0; i < n; ++i) {
+            char c = modules[i].symbol;
+            leftContext[i] = last;
+            if (c == '[') {
+                saved.push_back(last);
+            } else if (c == ']') {
+                if (!saved.empty()) {
+                    last = saved.back();
+                    saved.pop_back();
+                }
+            } else if (!isIgnored[(unsigned char)c]) {
+                last = c;
+            }
+        }
+
+        saved.clear();
+        char next = 0;
+        for (size_t i = n; i-- > 0;) {
+            char c = modules[i].symbol;
+            rightContext[i] = next;
+            if (c == ']') {
+                saved.push_back(next);
+                next = 0;
+            } else if (c == '[') {
+                if (!saved.empty()) {
+                    next = saved.back();
+                    saved.pop_back();
+                }
+            } else if (!isIgnored[(unsigned char)c]) {
+                next = c;
+            }
+        }
+    }
+
+    [[nodiscard]] static bool matches(const Production& production, char left, char right) {
+        return (production.left == 0 or production.left == left) and
+               (production.right == 0 or production.right == right);
+    }
+
+    // Index of the production chosen for the module at `position`, or -1 when it is not rewritten.
+    // Rules with a context take precedence over the ones without, as usual for L-systems.
+    [[nodiscard]] int choose(char c, int gen, uint64_t position, char left, char right) const {
+        const std::vector<Production>& alternatives = rules[(unsigned char)c];
+        if (alternatives.empty())
+            return -1;
+
+        if (!hasContextRules) {
+            double r = positionRandom(seed, gen, position) * totalWeight[(unsigned char)c];
+            for (int k = 0; k + 1 < int(alternatives.size()); ++k) {
+                if (r < alternatives[k].weight)
+                    return k;
+                r -= alternatives[k].weight;
+            }
+            return int(alternatives.size()) - 1;
+        }
+
+        bool isContextMatched = false;
+        double weight = 0;
+        for (const Production& production : alternatives) {
+            if ((production.left != 0 or production.right != 0) and matches(production, left, right)) {
+                if (!isContextMatched)
+                    weight = 0;
+                isContextMatched = true;
+                weight += production.weight;
+            } else if (!isContextMatched and production.left == 0 and production.right == 0) {
+                weight += production.weight;
+            }
+        }
+        if (weight == 0)
+            return -1;
+
+        double r = positionRandom(seed, gen, position) * weight;
+        int chosen = -1;
+        for (int k = 0; k < int(alternatives.size()); ++k) {
+            const Production& production = alternatives[k];
+            bool hasContext = production.left != 0 or production.right != 0;
+            if (isContextMatched ? !(hasContext and matches(production, left, right)) : hasContext)
+                continue;
+            chosen = k;
+            if (r < production.weight)
+                break;
+            r -= production.weight;
+        }
+        return chosen;
+    }
+public:
+    StochasticLSystem(const std::string& _axiom, const std::vector<std::pair<char, Production>>& _rules,
+                      const std::string& drawingSymbols, int _angle, int _gens, uint64_t _seed) {
+        initAxiom = parseModules(_axiom);
+        word = initAxiom;
+        angle = _angle;
+        gens = _gens;
+        seed = _seed;
+
+        totalWeight.fill(0);
+        isDrawingSymbol.fill(false);
+        isIgnored.fill(false);
+        hasContextRules = false;
+        for (const std::pair<char, Production>& rule : _rules) {
+            rules[(unsigned char)rule.first].push_back(rule.second);
+            totalWeight[(unsigned char)rule.first] += rule.second.weight;
+            hasContextRules = hasContextRules or rule.second.left != 0 or rule.second.right != 0;
+        }
+        for (char c : drawingSymbols) {
+            isDrawingSymbol[(unsigned char)c] = true;
+        }
+    }
+
+    // Symbols context-sensitive rules look through, e.g. "+-F"
+    void setIgnored(const std::string& symbols) {
+        isIgnored.fill(false);
+        for (char c : symbols) {
+            isIgnored[(unsigned char)c] = true;
+        }
+    }
+
+    // Writes generation `gen` into `to`, rewriting generation gen - 1 given in `from`.
+    // Same two passes as LSystem::applyRules(): output lengths of the parts, then the
+    // parts are written by separate threads at their offsets. Neighbours are found once
+    // per generation beforehand, so the rule lookup stays O(1) in every part.
+    // Returns false when control cancels the rewrite, `to` is incomplete then.
+    bool rewrite(const std::vector<Module>& from, std::vector<Module>& to, int gen,
+                 BuildControl* control = nullptr) const {
+        std::vector<char> leftContext, rightContext;
+        if (hasContextRules) {
+            findContexts(from, leftContext, rightContext);
+        }
+        auto chooseAt = [&](size_t i) {
+            return hasContextRules ? choose(from[i].symbol, gen, i, leftContext[i], rightContext[i])
+                                   : choose(from[i].symbol, gen, i, 0, 0);
+        };
+
+        int parts = partsNumber(from.size(), MIN_PARALLEL_CHUNK);
+        std::vector<size_t> offsets(parts + 1, 0);
+
+        auto partBegin = [&](int part) { return from.size() * part / parts; };
+        // looked at every BUILD_CHECK_INTERVAL modules of a part
+        auto isCancelled = [&](size_t i, int part) {
+            return control != nullptr and (i - partBegin(part)) % BUILD_CHECK_INTERVAL == 0 and control->isCancelled;
+        };
+
+        runParallel(parts, [&](int part) {
+            size_t length = 0;
+            for (size_t i = partBegin(part); i < partBegin(part + 1); ++i) {
+                if (isCancelled(i, part))
+                    return;
+                int k = chooseAt(i);
+                length += k < 0 ? 1 : rules[(unsigned char)from[i].symbol][k].successor.size();
+            }
+            offsets[part + 1] = length;
+        });
+        if (control != nullptr and control->isCancelled)
+            return false;
+        for (int part = 0; part < parts; ++part) {
+            offsets[part + 1] += offsets[part];
+        }
+
+        to.resize(offsets[parts]);
+        runParallel(parts, [&](int part) {
+            Module* out = to.data() + offsets[part];
+            for (size_t i = partBegin(part); i < partBegin(part + 1); ++i) {
+                if (isCancelled(i, part))
+                    return;
+                const Module& parent = from[i];
+                int k = chooseAt(i);
+                if (k < 0) {
+                    *out++ = parent;
+                    continue;
+                }
+                for (const Module& child : rules[(unsigned char)parent.symbol][k].successor) {
+                    *out++ = {child.symbol, parent.length * child.length};
+                }
+            }
+        });
+        return control == nullptr or !control->isCancelled;
+    }
+
+    void applyRules(int gen) {
+        rewrite(word, buffer, gen);
+        word.swap(buffer);
+    }
+
+    void generate() {
+        for (int gen = 1; gen <= gens; ++gen) {
+            applyRules(gen);
+        }
+    }
+
+    [[nodiscard]] const std::vector<Module>& getInitAxiom() const { return initAxiom; }
+    [[nodiscard]] const std::vector<Module>& getWord() const { return word; }
+    [[nodiscard]] bool isDrawing(char c) const { return isDrawingSymbol[(unsigned char)c]; }
+    [[nodiscard]] int getAngle() const { return angle; }
+    [[nodiscard]] int getGens() const { return gens; }
+
+    [[nodiscard]] size_t getMemoryUsage() const {
+        return (initAxiom.capacity() + word.capacity() + buffer.capacity()) * sizeof(Module);
+    }
+};
+
+// Expanded words of stochastic L-systems kept between builds, up to byteBudget bytes.
+// Generation n is rewritten from the closest cached generation below it, so stepping
+// the generation up costs a single rewrite. Least recently used words are dropped first.
+class GenerationCache {
+private:
+    typedef std::pair<std::string, int> Key;
+    typedef std::shared_ptr<const std::vector<Module>> Word;
+
+    std::mutex mutex;
+    // sorted, so the closest generation below a wanted one is a neighbour in the map
+    LruCache<Key, Word> words;
+public:
+    explicit GenerationCache(size_t _byteBudget) : words(_byteBudget) {
+    }
+
+    // Word of lSystem after gens rewrites. name identifies the system, its rules and its seed.
+    // nullptr when control cancels the rewriting; the generations finished by then stay cached.
+    Word get(const std::string& name, const StochasticLSystem* lSystem, int gens, BuildControl* control = nullptr) {
+        Word word;
+        int from = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = words.getEntries().upper_bound(Key(name, gens));
+            if (it != words.getEntries().begin() and std::prev(it)->first.first == name) {
+                Key key = std::prev(it)->first;
+                from = key.second;
+                word = *words.use(key);
+            }
+        }
+        if (word == nullptr)
+            word = std::make_shared<const std::vector<Module>>(lSystem->getInitAxiom());
+
+        for (int gen = from + 1; gen <= gens; ++gen) {
+            std::shared_ptr<std::vector<Module>> next = std::make_shared<std::vector<Module>>();
+            if (!lSystem->rewrite(*word, *next, gen, control))
+                return nullptr;
+            word = next;
+
+            std::lock_guard<std::mutex> lock(mutex);
+            words.insert(Key(name, gen), word, word->capacity() * sizeof(Module));
+            words.trim();
+        }
+        return word;
+    }
+
+    [[nodiscard]] size_t getBytesUsed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return words.getBytesUsed();
+    }
+};
+
+inline GenerationCache& generationCache() {
+    static GenerationCache cache(GENERATION_CACHE_BYTES);
+    return cache;
+}
+
+// Feeds the modules of the word to the robot, emitting the vertices of its line strip through
+// onVertex(x, y, isVisible). Drawing modules move the robot by their length; '[' and ']' are
+// always enabled. Returns the strip state the word ends in, see endStrip().
+// With control set the progress is reported and the walk stops once it is cancelled.
+template <typename OnVertex>
+uint8_t interpretModules(const std::vector<Module>& word, const StochasticLSystem* lSystem, Robot* robot,
+                         OnVertex onVertex, BuildControl* control = nullptr) {
+    uint8_t strip = 0;
+    uint64_t count = 0;
+    for (const Module& module : word) {
+        if (control != nullptr and ++count == BUILD_CHECK_INTERVAL) {
+            control->done += count;
+            count = 0;
+            if (control->isCancelled)
+                return strip;
+        }
+
+        char c = module.symbol;
+        if (lSystem->isDrawing(c)) {
+            addVertex(robot, strip, onVertex);
+            robot->move(module.length);
+        } else if (c == '-') {
+            robot->rotate(+lSystem->getAngle());
+            strip |= STRIP_TURNED;
+        } else if (c == '+') {
+            robot->rotate(-lSystem->getAngle());
+            strip |= STRIP_TURNED;
+        } else if (c == '[') {
+            robot->getMemory()->push(robot->getData());
+        } else if (c == ']') {
+            closeBranch(robot, strip, onVertex);
+        }
+    }
+    if (control != nullptr)
+        control->done += count;
+    return strip;
+}
+
+#endif //SPBU_SEMESTER1_FRACTALS_STOCHASTIC_H
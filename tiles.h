@@ -0,0 +1,248 @@
+#ifndef SPBU_SEMESTER1_FRACTALS_TILES_H
+#define SPBU_SEMESTER1_FRACTALS_TILES_H
+
+#include <SFML/Graphics.hpp>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <cmath>
+
+#include "parallel.h"
+#include "figure.h"
+#include "raster.h"
+#include "lru.h"
+
+// Tile pixels per side
+const int TILE_SIZE = 256;
+const size_t TILE_BYTES = size_t(TILE_SIZE) * TILE_SIZE * 4;
+
+// A tile of zoom level `level` covers TILE_SIZE * 2^-level world units per side
+struct TileKey {
+    int level;
+    long x, y;
+
+    bool operator==(const TileKey& other) const { return level == other.level and x == other.x and y == other.y; }
+};
+
+struct TileKeyHash {
+    size_t operator()(const TileKey& key) const {
+        size_t h = std::hash<long>()(key.x);
+        h = h * 31 + std::hash<long>()(key.y);
+        return h * 31 + std::hash<int>()(key.level);
+    }
+};
+
+// Renders the figure as tiles rasterized by a background worker pool. Finished tiles
+// are kept per zoom level in an LRU cache bounded by bytes; draw() only composites
+// what is cached, falling back to coarser levels, and requests what is missing.
+class TileRenderer {
+private:
+    struct Tile {
+        bool isReady;
+        std::vector<sf::Uint8> pixels;
+        sf::Texture* texture;
+    };
+
+    struct Source {
+        std::shared_ptr<LSystem> lSystem;
+        std::string robotName;
+        ColorMode colorMode;
+        // steps of the whole figure, for the arc-length gradient
+        uint64_t steps;
+        int version;
+    };
+
+    std::mutex mutex;
+    LruCache<TileKey, Tile, std::unordered_map<TileKey, LruEntry<TileKey, Tile>, TileKeyHash>> tiles;
+    // newest requests are served first, so the current view wins over old ones
+    std::vector<TileKey> requests;
+    // tasks submitted to the pool and not started yet
+    size_t queuedTasks;
+    Source source;
+    // destroyed first, so no worker outlives the cache
+    ThreadPool pool;
+
+    static long floorDiv(long a, long b) {
+        long q = a / b;
+        return (a % b != 0 and (a < 0) != (b < 0)) ? q - 1 : q;
+    }
+
+    static double tileWorldSize(int level) { return TILE_SIZE * std::ldexp(1.0, -level); }
+
+    void renderNext() {
+        TileKey key{};
+        Source current;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            --queuedTasks;
+            if (requests.empty())
+                return;
+            key = requests.back();
+            requests.pop_back();
+            current = source;
+        }
+
+        double size = tileWorldSize(key.level);
+        double scale = size / TILE_SIZE;
+        sf::FloatRect area(float(key.x * size), float(key.y * size), float(size), float(size));
+
+        Robot robot(current.robotName, 0, HEIGHT);
+        placeRobot(&robot, current.robotName, current.lSystem.get());
+        sf::VertexArray strip(sf::LinesStrip);
+        Coloring coloring(current.colorMode, figureColor(current.robotName), current.steps);
+        makeFigureInView(strip, current.lSystem.get(), &robot, usesMemory(current.robotName), area, float(scale),
+                         nullptr, &coloring);
+
+        std::vector<sf::Uint8> pixels(TILE_BYTES, 0);
+        rasterizeStrip(strip, area.left, area.top, scale, TILE_SIZE, TILE_SIZE, pixels);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Tile* tile = tiles.find(key);
+        if (source.version != current.version or tile == nullptr)
+            return;
+        tile->pixels.swap(pixels);
+        tile->isReady = true;
+    }
+
+    void request(const TileKey& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!tiles.insert(key, Tile{false, {}, nullptr}, TILE_BYTES))
+            return;
+        requests.push_back(key);
+        if (queuedTasks < requests.size()) {
+            ++queuedTasks;
+            pool.submit([this] { renderNext(); });
+        }
+    }
+
+    // Forgets requests no worker has started yet, draw() asks again for what is still visible
+    void cancelRequests() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const TileKey& key : requests) {
+            tiles.erase(key);
+        }
+        requests.clear();
+    }
+
+    // Texture of a finished tile, uploaded on first use. Main thread only.
+    const sf::Texture* find(const TileKey& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Tile* tile = tiles.find(key);
+        if (tile == nullptr or !tile->isReady)
+            return nullptr;
+
+        tiles.use(key);
+        if (tile->texture == nullptr) {
+            tile->texture = new sf::Texture();
+            tile->texture->create(TILE_SIZE, TILE_SIZE);
+            tile->texture->update(tile->pixels.data());
+            std::vector<sf::Uint8>().swap(tile->pixels);
+        }
+        return tile->texture;
+    }
+
+    // Drops least recently used finished tiles until the cache fits its budget
+    void trim() {
+        std::lock_guard<std::mutex> lock(mutex);
+        // tiles still being rendered are waited for
+        tiles.trim([](Tile& tile) {
+            if (!tile.isReady)
+                return false;
+            delete tile.texture;
+            return true;
+        });
+    }
+
+    void clear() {
+        tiles.clear([](Tile& tile) { delete tile.texture; });
+        requests.clear();
+    }
+public:
+    explicit TileRenderer(size_t _byteBudget) : tiles(_byteBudget), pool(threadsNumber()) {
+        queuedTasks = 0;
+        source.colorMode = ColorMode::Flat;
+        source.steps = 0;
+        source.version = 0;
+    }
+
+    ~TileRenderer() {
+        std::lock_guard<std::mutex> lock(mutex);
+        clear();
+    }
+
+    void setFigure(const std::string& robotName, int gensNumber, ColorMode colorMode) {
+        std::shared_ptr<LSystem> lSystem(createLSystem(robotName, gensNumber));
+        uint64_t steps = 0;
+        if (lSystem != nullptr)
+            steps = MacroSteps(lSystem.get(), usesMemory(robotName)).compose(lSystem->getInitAxiom(), gensNumber).moves;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        clear();
+        source.lSystem = lSystem;
+        source.robotName = robotName;
+        source.colorMode = colorMode;
+        source.steps = steps;
+        ++source.version;
+    }
+
+    // Rendered tiles are dropped when the mode changes
+    void setColorMode(ColorMode colorMode) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (source.colorMode == colorMode)
+            return;
+        clear();
+        source.colorMode = colorMode;
+        ++source.version;
+    }
+
+    // Stochastic figures can't be built tile by tile, the caller draws them whole instead
+    [[nodiscard]] bool canDraw() const { return source.lSystem != nullptr; }
+
+    void draw(sf::RenderTarget& target, const sf::View& view) {
+        if (!canDraw())
+            return;
+
+        double worldPerPixel = view.getSize().x / target.getSize().x;
+        int level = std::max(-16, std::min(40, int(std::ceil(-std::log2(worldPerPixel)))));
+        double size = tileWorldSize(level);
+
+        sf::Vector2f topLeft = view.getCenter() - view.getSize() / 2.f;
+        sf::Vector2f bottomRight = view.getCenter() + view.getSize() / 2.f;
+        long minX = long(std::floor(topLeft.x / size)), maxX = long(std::floor(bottomRight.x / size));
+        long minY = long(std::floor(topLeft.y / size)), maxY = long(std::floor(bottomRight.y / size));
+
+        cancelRequests();
+        for (long y = minY; y <= maxY; ++y) {
+            for (long x = minX; x <= maxX; ++x) {
+                TileKey key{level, x, y};
+                const sf::Texture* texture = find(key);
+                if (texture == nullptr) {
+                    request(key);
+                }
+
+                // Until the tile is ready, stretch the part of a coarser tile covering it
+                int up = 0;
+                while (texture == nullptr and up < 4) {
+                    ++up;
+                    texture = find({level - up, floorDiv(x, 1L << up), floorDiv(y, 1L << up)});
+                }
+                if (texture == nullptr)
+                    continue;
+
+                int part = TILE_SIZE >> up;
+                sf::Sprite sprite(*texture);
+                sprite.setTextureRect(sf::IntRect(int(x - (floorDiv(x, 1L << up) << up)) * part,
+                                                  int(y - (floorDiv(y, 1L << up) << up)) * part, part, part));
+                sprite.setPosition(float(x * size), float(y * size));
+                sprite.setScale(float(size / part), float(size / part));
+                target.draw(sprite);
+            }
+        }
+
+        trim();
+    }
+};
+
+#endif //SPBU_SEMESTER1_FRACTALS_TILES_H